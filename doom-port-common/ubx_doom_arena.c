@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ubx_doom_arena.h"
+
+// Each allocation is preceded by its size, rounded up like the allocation so
+// the data after it stays aligned
+#define HEADER_SIZE     U_DOOM_ARENA_ALIGNMENT
+#define ALIGN_UP(x)     (((x) + U_DOOM_ARENA_ALIGNMENT - 1) & ~(size_t)(U_DOOM_ARENA_ALIGNMENT - 1))
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL    __declspec(thread)
+#else
+#define THREAD_LOCAL    _Thread_local
+#endif
+
+typedef struct uDoomArenaChunk {
+    struct uDoomArenaChunk *pPrevious;
+    size_t capacity;
+    size_t top;
+    uint8_t *pData;
+} uDoomArenaChunk_t;
+
+static uDoomArena_t gDefaultArena = {NULL, 0, 0, 0, true};
+static THREAD_LOCAL uDoomArena_t *gpArena = &gDefaultArena;
+
+static uDoomArenaChunk_t *newChunk(size_t capacity, uDoomArenaChunk_t *pPrevious)
+{
+    uDoomArenaChunk_t *pChunk = (uDoomArenaChunk_t *)malloc(sizeof(uDoomArenaChunk_t) + capacity +
+                                                            U_DOOM_ARENA_ALIGNMENT);
+
+    if (pChunk != NULL) {
+        pChunk->pPrevious = pPrevious;
+        pChunk->capacity = capacity;
+        pChunk->top = 0;
+        pChunk->pData = (uint8_t *)ALIGN_UP((uintptr_t)(pChunk + 1));
+    }
+
+    return pChunk;
+}
+
+static void freeChunks(uDoomArena_t *pArena)
+{
+    while (pArena->pChunk != NULL) {
+        uDoomArenaChunk_t *pPrevious = pArena->pChunk->pPrevious;
+        free(pArena->pChunk);
+        pArena->pChunk = pPrevious;
+    }
+}
+
+static size_t getSize(const void *pPtr)
+{
+    return *(const size_t *)((const uint8_t *)pPtr - HEADER_SIZE);
+}
+
+// Whether pPtr is the most recent allocation of the current chunk
+static bool isLast(const uDoomArena_t *pArena, const void *pPtr)
+{
+    const uDoomArenaChunk_t *pChunk = pArena->pChunk;
+
+    return (pChunk != NULL) &&
+           ((const uint8_t *)pPtr + ALIGN_UP(getSize(pPtr)) == pChunk->pData + pChunk->top);
+}
+
+void uDoomArenaInit(uDoomArena_t *pArena)
+{
+    pArena->pChunk = NULL;
+    pArena->used = 0;
+    pArena->highWaterMark = 0;
+    pArena->capacity = 0;
+    pArena->needsResize = true;
+}
+
+void uDoomArenaSelect(uDoomArena_t *pArena)
+{
+    gpArena = (pArena != NULL) ? pArena : &gDefaultArena;
+}
+
+void *uDoomArenaMalloc(size_t size)
+{
+    uDoomArena_t *pArena = gpArena;
+    size_t needed = HEADER_SIZE + ALIGN_UP(size);
+    uint8_t *pBlock;
+
+    if ((pArena->pChunk == NULL) || (pArena->pChunk->capacity - pArena->pChunk->top < needed)) {
+        size_t capacity = (needed > U_DOOM_ARENA_CHUNK_SIZE) ? needed : U_DOOM_ARENA_CHUNK_SIZE;
+        uDoomArenaChunk_t *pChunk = newChunk(capacity, pArena->pChunk);
+        if (pChunk == NULL) {
+            return NULL;
+        }
+        pArena->pChunk = pChunk;
+        pArena->needsResize = true;
+    }
+
+    pBlock = pArena->pChunk->pData + pArena->pChunk->top;
+    *(size_t *)pBlock = size;
+    pArena->pChunk->top += needed;
+    pArena->used += needed;
+    if (pArena->used > pArena->highWaterMark) {
+        pArena->highWaterMark = pArena->used;
+    }
+
+    return pBlock + HEADER_SIZE;
+}
+
+void *uDoomArenaRealloc(void *pPtr, size_t size)
+{
+    uDoomArena_t *pArena = gpArena;
+    void *pNew;
+
+    if (pPtr == NULL) {
+        return uDoomArenaMalloc(size);
+    }
+
+    if (isLast(pArena, pPtr)) {
+        uDoomArenaChunk_t *pChunk = pArena->pChunk;
+        size_t oldAligned = ALIGN_UP(getSize(pPtr));
+        size_t newAligned = ALIGN_UP(size);
+        if (pChunk->top - oldAligned + newAligned <= pChunk->capacity) {
+            pChunk->top = pChunk->top - oldAligned + newAligned;
+            pArena->used = pArena->used - oldAligned + newAligned;
+            if (pArena->used > pArena->highWaterMark) {
+                pArena->highWaterMark = pArena->used;
+            }
+            *(size_t *)((uint8_t *)pPtr - HEADER_SIZE) = size;
+            return pPtr;
+        }
+    }
+
+    pNew = uDoomArenaMalloc(size);
+    if (pNew != NULL) {
+        size_t oldSize = getSize(pPtr);
+        memcpy(pNew, pPtr, (oldSize < size) ? oldSize : size);
+    }
+
+    return pNew;
+}
+
+void uDoomArenaFree(void *pPtr)
+{
+    uDoomArena_t *pArena = gpArena;
+
+    if ((pPtr != NULL) && isLast(pArena, pPtr)) {
+        size_t needed = HEADER_SIZE + ALIGN_UP(getSize(pPtr));
+        pArena->pChunk->top -= needed;
+        pArena->used -= needed;
+    }
+}
+
+bool uDoomArenaReset(void)
+{
+    uDoomArena_t *pArena = gpArena;
+    bool resized = false;
+
+    if (pArena->needsResize && (pArena->highWaterMark > 0)) {
+        // Some headroom, so that slightly larger frames don't spill over
+        size_t capacity = ALIGN_UP(pArena->highWaterMark + pArena->highWaterMark / 4);
+        freeChunks(pArena);
+        pArena->pChunk = newChunk(capacity, NULL);
+        if (pArena->pChunk != NULL) {
+            // Fault the pages in now rather than during the next frames
+            memset(pArena->pChunk->pData, 0, capacity);
+            pArena->capacity = capacity;
+            resized = true;
+        } else {
+            pArena->capacity = 0;
+        }
+        pArena->needsResize = false;
+    }
+
+    if (pArena->pChunk != NULL) {
+        pArena->pChunk->top = 0;
+    }
+    pArena->used = 0;
+
+    return resized;
+}
+
+size_t uDoomArenaGetHighWaterMark(void)
+{
+    return gpArena->highWaterMark;
+}
+
+size_t uDoomArenaGetCapacity(void)
+{
+    return gpArena->capacity;
+}
+
+// lodepng is built with LODEPNG_NO_COMPILE_ALLOCATORS and uses these
+void *lodepng_malloc(size_t size)
+{
+    return uDoomArenaMalloc(size);
+}
+
+void *lodepng_realloc(void *pPtr, size_t size)
+{
+    return uDoomArenaRealloc(pPtr, size);
+}
+
+void lodepng_free(void *pPtr)
+{
+    uDoomArenaFree(pPtr);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Bump allocator for everything that lives no longer than a frame. It backs
+// lodepng_malloc(), lodepng_realloc() and lodepng_free(), lodepng being built
+// with LODEPNG_NO_COMPILE_ALLOCATORS, so encoding a frame costs a few pointer
+// increments instead of heap calls and touches the same pages every frame.
+//
+// The first frame runs on chunks allocated as needed, the first reset then
+// replaces them by a single arena sized from the high-water mark. A frame that
+// doesn't fit gets extra chunks and the arena is resized at the next reset, so
+// the memory in use stays at what the largest frame needed.
+//
+// Every thread allocates from an arena of its own, selected with
+// uDoomArenaSelect(), so there is no locking. The game thread and any thread
+// that didn't select one share the default arena, which makes them game
+// thread only.
+
+// Alignment of every allocation
+#define U_DOOM_ARENA_ALIGNMENT      16
+
+// Size of the chunks allocated as needed, unless an allocation is larger
+#define U_DOOM_ARENA_CHUNK_SIZE     (256 * 1024)
+
+typedef struct uDoomArena {
+    // The chunk allocations are bumped from, the ones before it are full
+    struct uDoomArenaChunk *pChunk;
+    size_t used;
+    size_t highWaterMark;
+    size_t capacity;
+    // Set while the chunks in use are not just the one sized arena
+    bool needsResize;
+} uDoomArena_t;
+
+void uDoomArenaInit(uDoomArena_t *pArena);
+
+// The calling thread allocates from pArena from now on, or from the default
+// arena if it is NULL. The functions below all work on the arena selected.
+void uDoomArenaSelect(uDoomArena_t *pArena);
+
+void *uDoomArenaMalloc(size_t size);
+
+// Grows the last allocation in place, otherwise copies it
+void *uDoomArenaRealloc(void *pPtr, size_t size);
+
+// Only the last allocation is actually given back, the rest waits for the reset
+void uDoomArenaFree(void *pPtr);
+
+// Releases everything allocated since the last reset in one go, call it at the
+// end of every frame. Returns true if the arena was resized.
+bool uDoomArenaReset(void);
+
+// Most bytes in use at once since the start, headers and alignment included
+size_t uDoomArenaGetHighWaterMark(void);
+
+// Size of the arena as of the last reset
+size_t uDoomArenaGetCapacity(void);
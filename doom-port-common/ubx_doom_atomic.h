@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+// Hands a uint32_t over from one thread to another without locks: whatever
+// the writer did before U_DOOM_STORE_RELEASE() is seen by a reader once
+// U_DOOM_LOAD_ACQUIRE() gives it the new value. Enough for a single writer.
+#if defined(_MSC_VER)
+// MSVC gives volatile accesses acquire/release semantics (/volatile:ms)
+#define U_DOOM_LOAD_ACQUIRE(p)      (*(volatile uint32_t *)(p))
+#define U_DOOM_STORE_RELEASE(p, v)  (*(volatile uint32_t *)(p) = (v))
+#else
+#define U_DOOM_LOAD_ACQUIRE(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define U_DOOM_STORE_RELEASE(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
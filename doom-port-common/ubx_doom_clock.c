@@ -0,0 +1,32 @@
+#include "ubx_doom_clock.h"
+
+void uDoomScheduleInit(uDoomSchedule_t *pSchedule, uint32_t periodUs, uint32_t divisor)
+{
+    pSchedule->startUs = uDoomClockGetUs();
+    pSchedule->count = 0;
+    pSchedule->periodUs = periodUs;
+    pSchedule->divisor = (divisor > 0) ? divisor : 1;
+}
+
+void uDoomScheduleWait(uDoomSchedule_t *pSchedule)
+{
+    uint64_t nowUs = uDoomClockGetUs();
+    uint64_t deadlineUs;
+
+    ++pSchedule->count;
+    // From the start rather than from the previous deadline, no rounding
+    // error accumulates either
+    deadlineUs = pSchedule->startUs + pSchedule->count * pSchedule->periodUs / pSchedule->divisor;
+
+    if (nowUs > deadlineUs + pSchedule->periodUs / pSchedule->divisor) {
+        pSchedule->startUs = nowUs;
+        pSchedule->count = 0;
+    } else {
+        uDoomClockSleepUntilUs(deadlineUs);
+    }
+}
+
+uint32_t uDoomClockGetMsSince(uint64_t startUs)
+{
+    return (uint32_t)((uDoomClockGetUs() - startUs) / 1000);
+}
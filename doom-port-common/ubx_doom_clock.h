@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+// Monotonic time in microseconds, from an arbitrary start. Implemented by each
+// port, like the DG_ functions.
+uint64_t uDoomClockGetUs(void);
+
+// Sleeps until uDoomClockGetUs() reaches deadlineUs, returns right away if it
+// already has. Implemented by each port.
+void uDoomClockSleepUntilUs(uint64_t deadlineUs);
+
+// Paces a loop to a fixed period with absolute deadlines, so the time spent
+// in the loop itself and the sleeping inaccuracies don't add up into drift.
+// The period is periodUs / divisor, which keeps rates like 35 Hz exact.
+typedef struct uDoomSchedule {
+    uint64_t startUs;
+    uint64_t count;
+    uint32_t periodUs;
+    uint32_t divisor;
+} uDoomSchedule_t;
+
+void uDoomScheduleInit(uDoomSchedule_t *pSchedule, uint32_t periodUs, uint32_t divisor);
+
+// Sleeps until the next deadline. A caller running more than a period late
+// isn't made to catch up with a burst, the schedule starts over from now.
+void uDoomScheduleWait(uDoomSchedule_t *pSchedule);
+
+// Milliseconds since startUs, a uDoomClockGetUs() time
+uint32_t uDoomClockGetMsSince(uint64_t startUs);
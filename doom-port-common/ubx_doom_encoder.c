@@ -0,0 +1,377 @@
+#include <string.h>
+#include "ubx_doom_arena.h"
+#include "ubx_doom_encoder.h"
+#include "ubx_doom_qoi.h"
+
+// Matches must reach back over the whole reference
+#define VIDEO_WINDOW_SIZE   32768
+
+void uDoomEncoderInit(uDoomEncoder_t *pEncoder, int32_t huffmanReusePercent, uDoomCodec_t codec)
+{
+    pEncoder->reuseHuffman = huffmanReusePercent >= 0;
+    pEncoder->huffmanReusePercent = pEncoder->reuseHuffman ? (uint32_t)huffmanReusePercent : 0;
+    lodepng_huffman_cache_init(&pEncoder->huffmanCache);
+    pEncoder->codec = codec;
+    pEncoder->keyframeRequested = false;
+    pEncoder->framesSinceKeyframe = 0;
+    pEncoder->paletteSize = 0;
+    pEncoder->referenceSize = 0;
+    pEncoder->lastEstimate = 0;
+    pEncoder->estimatedRowsLeft = 0;
+    pEncoder->estimatedRowsSize = 0;
+    pEncoder->estimateCorrection = 1.0F;
+}
+
+static void setHuffmanCache(uDoomEncoder_t *pEncoder, LodePNGCompressSettings *pSettings)
+{
+    if (pEncoder->reuseHuffman) {
+        pSettings->huffman_cache = &pEncoder->huffmanCache;
+        pSettings->huffman_reuse_threshold = pEncoder->huffmanReusePercent;
+    }
+}
+
+static uint32_t encodePng(uDoomEncoder_t *pEncoder, uint8_t **ppPng, size_t *pPngSize,
+                          const uint8_t *pImage, uint32_t width, uint32_t height)
+{
+    LodePNGState state;
+    uint32_t error;
+
+    // Same as lodepng_encode32(), plus the settings carried across frames
+    lodepng_state_init(&state);
+    state.info_raw.colortype = LCT_RGBA;
+    state.info_raw.bitdepth = 8;
+    setHuffmanCache(pEncoder, &state.encoder.zlibsettings);
+    error = lodepng_encode(ppPng, pPngSize, pImage, width, height, &state);
+    lodepng_state_cleanup(&state);
+
+    return error;
+}
+
+// Palette mode with the palette kept in the encoder, or 8 bit RGB if it is empty
+static uint32_t makeColorMode(const uDoomEncoder_t *pEncoder, LodePNGColorMode *pMode)
+{
+    uint32_t error = 0;
+
+    lodepng_color_mode_init(pMode);
+    pMode->bitdepth = 8;
+    pMode->colortype = (pEncoder->paletteSize > 0) ? LCT_PALETTE : LCT_RGB;
+    for (size_t i = 0; (i < pEncoder->paletteSize) && !error; ++i) {
+        const uint8_t *pColor = &pEncoder->palette[i * 4];
+        error = lodepng_palette_add(pMode, pColor[0], pColor[1], pColor[2], pColor[3]);
+    }
+
+    return error;
+}
+
+// Converts the image to palette indices, or RGB if it has too many colors,
+// building a new palette only if the current one misses a color
+static uint32_t convertImage(uDoomEncoder_t *pEncoder, LodePNGColorMode *pMode, uint8_t *pPixels,
+                             const uint8_t *pImage, uint32_t width, uint32_t height)
+{
+    LodePNGColorMode rgba = lodepng_color_mode_make(LCT_RGBA, 8);
+    LodePNGColorStats stats;
+    uint32_t error = 82;
+
+    if (pEncoder->paletteSize > 0) {
+        error = makeColorMode(pEncoder, pMode);
+        if (!error) {
+            error = lodepng_convert(pPixels, pImage, pMode, &rgba, width, height);
+        }
+        if (error) {
+            lodepng_color_mode_cleanup(pMode);
+        }
+    }
+
+    if (error == 82) {
+        // Color not in the palette
+        lodepng_color_stats_init(&stats);
+        error = lodepng_compute_color_stats(&stats, pImage, width, height, &rgba);
+        if (!error) {
+            pEncoder->paletteSize = (stats.numcolors <= 256) ? stats.numcolors : 0;
+            memcpy(pEncoder->palette, stats.palette, pEncoder->paletteSize * 4);
+            error = makeColorMode(pEncoder, pMode);
+            if (!error) {
+                error = lodepng_convert(pPixels, pImage, pMode, &rgba, width, height);
+            }
+            if (error) {
+                lodepng_color_mode_cleanup(pMode);
+            }
+        }
+    }
+
+    return error;
+}
+
+// See ubx_doom_frame.h for the payload format
+static uint32_t encodeVideo(uDoomEncoder_t *pEncoder, uint8_t **ppPayload, size_t *pPayloadSize,
+                            const uint8_t *pImage, uint32_t width, uint32_t height)
+{
+    LodePNGColorMode mode;
+    LodePNGEncoderSettings settings;
+    uint8_t *pPixels;
+    uint8_t *pContent = NULL;
+    size_t paletteBytes = 0;
+    size_t contentSize = 0;
+    uint8_t *pZlib = NULL;
+    size_t zlibSize = 0;
+    bool isKeyframe = pEncoder->keyframeRequested || (pEncoder->referenceSize == 0) ||
+                      (pEncoder->framesSinceKeyframe >= U_DOOM_ENCODER_KEYFRAME_INTERVAL);
+    bool hasMode;
+    uint32_t error;
+
+    *ppPayload = NULL;
+    *pPayloadSize = 0;
+
+    pPixels = (uint8_t *)uDoomArenaMalloc((size_t)width * height * 3);
+    if (pPixels == NULL) {
+        return 83;
+    }
+    error = convertImage(pEncoder, &mode, pPixels, pImage, width, height);
+    hasMode = (error == 0);
+
+    if (!error) {
+        size_t lineBytes = (size_t)width * ((mode.colortype == LCT_PALETTE) ? 1 : 3);
+        paletteBytes = pEncoder->paletteSize * 3;
+        contentSize = paletteBytes + height * (1 + lineBytes);
+        pContent = (uint8_t *)uDoomArenaMalloc(contentSize);
+        if (pContent == NULL) {
+            error = 83;
+        }
+    }
+
+    if (!error) {
+        for (size_t i = 0; i < pEncoder->paletteSize; ++i) {
+            memcpy(&pContent[i * 3], &pEncoder->palette[i * 4], 3);
+        }
+        lodepng_encoder_settings_init(&settings);
+        error = lodepng_filter(&pContent[paletteBytes], pPixels, width, height, &mode, &settings);
+    }
+
+    if (!error) {
+        settings.zlibsettings.windowsize = VIDEO_WINDOW_SIZE;
+        setHuffmanCache(pEncoder, &settings.zlibsettings);
+        if (!isKeyframe) {
+            settings.zlibsettings.dictionary = pEncoder->reference;
+            settings.zlibsettings.dictionary_size = pEncoder->referenceSize;
+        }
+        error = lodepng_zlib_compress(&pZlib, &zlibSize, pContent, contentSize, &settings.zlibsettings);
+    }
+
+    if (!error) {
+        *ppPayload = (uint8_t *)uDoomArenaMalloc(zlibSize + 2);
+        if (*ppPayload == NULL) {
+            error = 83;
+        }
+    }
+
+    if (!error) {
+        (*ppPayload)[0] = (uint8_t)(pEncoder->paletteSize >> 8);
+        (*ppPayload)[1] = (uint8_t)pEncoder->paletteSize;
+        memcpy(&(*ppPayload)[2], pZlib, zlibSize);
+        *pPayloadSize = zlibSize + 2;
+
+        // The receiver keeps the same once it has decoded this frame
+        pEncoder->referenceSize = (contentSize < sizeof(pEncoder->reference)) ?
+                                  contentSize : sizeof(pEncoder->reference);
+        memcpy(pEncoder->reference, pContent, pEncoder->referenceSize);
+        pEncoder->keyframeRequested = false;
+        pEncoder->framesSinceKeyframe = isKeyframe ? 0 : pEncoder->framesSinceKeyframe + 1;
+    } else {
+        // Whatever the remote has now, it's not what the next frame would refer to
+        pEncoder->referenceSize = 0;
+    }
+
+    if (hasMode) {
+        lodepng_color_mode_cleanup(&mode);
+    }
+    uDoomArenaFree(pZlib);
+    uDoomArenaFree(pContent);
+    uDoomArenaFree(pPixels);
+
+    return error;
+}
+
+// Encoded at the worst case size, then given back what wasn't used
+static uint32_t encodeQoi(uint8_t **ppPayload, size_t *pPayloadSize,
+                          const uint8_t *pImage, uint32_t width, uint32_t height)
+{
+    uint8_t *pPayload;
+
+    *ppPayload = NULL;
+    *pPayloadSize = 0;
+
+    pPayload = (uint8_t *)uDoomArenaMalloc(U_DOOM_QOI_MAX_SIZE(width, height));
+    if (pPayload == NULL) {
+        return 83;
+    }
+    *pPayloadSize = uDoomQoiEncode(pPayload, pImage, width, height);
+    // The last allocation, it shrinks in place
+    *ppPayload = (uint8_t *)uDoomArenaRealloc(pPayload, *pPayloadSize);
+
+    return 0;
+}
+
+uint32_t uDoomEncoderEncode(uDoomEncoder_t *pEncoder, uint8_t **ppPayload, size_t *pPayloadSize,
+                            const uint8_t *pImage, uint32_t width, uint32_t height)
+{
+    uint32_t error;
+
+    switch (pEncoder->codec) {
+    case U_DOOM_CODEC_VIDEO_DEFLATE:
+        error = encodeVideo(pEncoder, ppPayload, pPayloadSize, pImage, width, height);
+        break;
+    case U_DOOM_CODEC_QOI:
+        error = encodeQoi(ppPayload, pPayloadSize, pImage, width, height);
+        break;
+    default:
+        error = encodePng(pEncoder, ppPayload, pPayloadSize, pImage, width, height);
+        break;
+    }
+
+    if (!error) {
+        uDoomEncoderLearn(pEncoder, *pPayloadSize, height);
+    }
+
+    return error;
+}
+
+void uDoomEncoderLearn(uDoomEncoder_t *pEncoder, size_t payloadSize, uint32_t height)
+{
+    // The sample misses the matches across bands, the palette choice of the
+    // full image and, in video deflate mode, the previous frame: learn by how
+    // much from the frames that were estimated and then encoded, possibly in
+    // several slices
+    if (pEncoder->lastEstimate > 0) {
+        pEncoder->estimatedRowsSize += payloadSize;
+        pEncoder->estimatedRowsLeft -= (height < pEncoder->estimatedRowsLeft) ?
+                                       height : pEncoder->estimatedRowsLeft;
+        if (pEncoder->estimatedRowsLeft == 0) {
+            float correction = (float)pEncoder->estimatedRowsSize / (float)pEncoder->lastEstimate;
+            pEncoder->estimateCorrection = (pEncoder->estimateCorrection + correction) / 2.0F;
+            pEncoder->lastEstimate = 0;
+        }
+    }
+}
+
+uint32_t uDoomEncoderEstimate(uDoomEncoder_t *pEncoder, size_t *pSize,
+                              const uint8_t *pImage, uint32_t width, uint32_t height)
+{
+    LodePNGColorMode rgba = lodepng_color_mode_make(LCT_RGBA, 8);
+    LodePNGColorMode mode;
+    LodePNGColorStats stats;
+    LodePNGEncoderSettings settings;
+    size_t rowBytes = (size_t)width * 4;
+    uint32_t bandRows = U_DOOM_ENCODER_ESTIMATE_BAND_ROWS;
+    uint32_t sampleHeight = 0;
+    uint8_t *pSample;
+    uint8_t *pPixels = NULL;
+    uint8_t *pFiltered = NULL;
+    uint8_t *pDeflated = NULL;
+    size_t deflatedSize = 0;
+    bool hasMode = false;
+    uint32_t error = 0;
+
+    *pSize = 0;
+
+    if (pEncoder->codec == U_DOOM_CODEC_QOI) {
+        // Faster than sampling deflate, and exact
+        uint8_t *pPayload;
+        error = encodeQoi(&pPayload, pSize, pImage, width, height);
+        uDoomArenaFree(pPayload);
+        return error;
+    }
+
+    // Whole bands rather than single rows, so the sample keeps the matches
+    // with the rows just above
+    for (uint32_t y = 0; y < height; y += bandRows * U_DOOM_ENCODER_ESTIMATE_STRIDE) {
+        sampleHeight += (height - y < bandRows) ? height - y : bandRows;
+    }
+    pSample = (uint8_t *)uDoomArenaMalloc(rowBytes * sampleHeight);
+    if (pSample == NULL) {
+        return 83;
+    }
+    for (uint32_t y = 0, row = 0; y < height; y += bandRows * U_DOOM_ENCODER_ESTIMATE_STRIDE) {
+        uint32_t rows = (height - y < bandRows) ? height - y : bandRows;
+        memcpy(&pSample[row * rowBytes], &pImage[y * rowBytes], rows * rowBytes);
+        row += rows;
+    }
+
+    // Same color choice as the encoders, from the sample alone
+    lodepng_color_mode_init(&mode);
+    lodepng_color_stats_init(&stats);
+    error = lodepng_compute_color_stats(&stats, pSample, width, sampleHeight, &rgba);
+    if (!error) {
+        hasMode = true;
+        mode.bitdepth = 8;
+        mode.colortype = (stats.numcolors <= 256) ? LCT_PALETTE : LCT_RGB;
+        for (size_t i = 0; (mode.colortype == LCT_PALETTE) && (i < stats.numcolors) && !error; ++i) {
+            const uint8_t *pColor = &stats.palette[i * 4];
+            error = lodepng_palette_add(&mode, pColor[0], pColor[1], pColor[2], pColor[3]);
+        }
+    }
+
+    if (!error) {
+        size_t lineBytes = (size_t)width * ((mode.colortype == LCT_PALETTE) ? 1 : 3);
+        pPixels = (uint8_t *)uDoomArenaMalloc(lineBytes * sampleHeight);
+        pFiltered = (uint8_t *)uDoomArenaMalloc((lineBytes + 1) * sampleHeight);
+        if ((pPixels == NULL) || (pFiltered == NULL)) {
+            error = 83;
+        }
+    }
+
+    if (!error) {
+        error = lodepng_convert(pPixels, pSample, &mode, &rgba, width, sampleHeight);
+    }
+    if (!error) {
+        lodepng_encoder_settings_init(&settings);
+        error = lodepng_filter(pFiltered, pPixels, width, sampleHeight, &mode, &settings);
+    }
+    if (!error) {
+        // The default window, a large one costs a lot more on the sample
+        // than it gains in accuracy
+        size_t filteredSize = ((size_t)width * lodepng_get_bpp(&mode) / 8 + 1) * sampleHeight;
+        error = lodepng_deflate(&pDeflated, &deflatedSize, pFiltered, filteredSize, &settings.zlibsettings);
+    }
+
+    if (!error) {
+        // Scaled up to the whole image, plus the palette
+        pEncoder->lastEstimate = (size_t)((uint64_t)deflatedSize * height / sampleHeight) +
+                                 mode.palettesize * 3;
+        pEncoder->estimatedRowsLeft = height;
+        pEncoder->estimatedRowsSize = 0;
+        *pSize = (size_t)((float)pEncoder->lastEstimate * pEncoder->estimateCorrection);
+    }
+
+    if (hasMode) {
+        lodepng_color_mode_cleanup(&mode);
+    }
+    uDoomArenaFree(pDeflated);
+    uDoomArenaFree(pFiltered);
+    uDoomArenaFree(pPixels);
+    uDoomArenaFree(pSample);
+
+    return error;
+}
+
+uint8_t uDoomEncoderGetFrameFlags(const uDoomEncoder_t *pEncoder)
+{
+    uint8_t flags = 0;
+
+    switch (pEncoder->codec) {
+    case U_DOOM_CODEC_VIDEO_DEFLATE:
+        flags = U_DOOM_FRAME_FLAG_VIDEO_DEFLATE;
+        break;
+    case U_DOOM_CODEC_QOI:
+        flags = U_DOOM_FRAME_FLAG_VIDEO_QOI;
+        break;
+    default:
+        break;
+    }
+
+    return flags;
+}
+
+void uDoomEncoderRequestKeyframe(uDoomEncoder_t *pEncoder)
+{
+    pEncoder->keyframeRequested = true;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "lodepng.h"
+#include "ubx_doom_frame.h"
+
+// In video deflate mode, frames without a preset dictionary are sent at
+// least this often so a receiver that lost its reference can resync
+#define U_DOOM_ENCODER_KEYFRAME_INTERVAL    100
+
+// The size estimate compresses one in this many bands of rows
+#define U_DOOM_ENCODER_ESTIMATE_STRIDE      8
+#define U_DOOM_ENCODER_ESTIMATE_BAND_ROWS   8
+
+// Payload formats, see ubx_doom_frame.h
+typedef enum {
+    U_DOOM_CODEC_PNG = 0,
+    U_DOOM_CODEC_VIDEO_DEFLATE,
+    U_DOOM_CODEC_QOI,           // See ubx_doom_qoi.h
+    U_DOOM_CODEC_MAX_NUM
+} uDoomCodec_t;
+
+// Encodes the successive frames of one stream, carrying over from one frame
+// to the next what can be reused
+typedef struct uDoomEncoder {
+    bool reuseHuffman;
+    uint32_t huffmanReusePercent;
+    LodePNGHuffmanCache huffmanCache;
+    uDoomCodec_t codec;
+    bool keyframeRequested;
+    uint32_t framesSinceKeyframe;
+    // Kept while the frames use no other colors, so the palette indices of
+    // unchanged pixels stay the same from one frame to the next
+    uint8_t palette[256 * 4];
+    size_t paletteSize;
+    // What the receiver keeps of the previous frame, see ubx_doom_frame.h
+    uint8_t reference[U_DOOM_VIDEO_REFERENCE_SIZE];
+    size_t referenceSize;
+    // Raw result of the last uDoomEncoderEstimate(), compared with the size of
+    // the frame encoded next to correct the estimates that follow, summed
+    // over the slices the estimated rows were encoded in
+    size_t lastEstimate;
+    uint32_t estimatedRowsLeft;
+    size_t estimatedRowsSize;
+    float estimateCorrection;
+} uDoomEncoder_t;
+
+// A negative huffmanReusePercent builds new Huffman trees for every frame,
+// otherwise the trees of earlier frames are reused as long as they are
+// estimated to cost at most that many percent more, which only matters to the
+// codecs built on deflate.
+void uDoomEncoderInit(uDoomEncoder_t *pEncoder, int32_t huffmanReusePercent, uDoomCodec_t codec);
+
+// Encodes an opaque RGBA image into a payload allocated from the frame arena,
+// valid until uDoomArenaReset(). Returns the lodepng error code, which the
+// QOI codec only gives for a failed allocation.
+uint32_t uDoomEncoderEncode(uDoomEncoder_t *pEncoder, uint8_t **ppPayload, size_t *pPayloadSize,
+                            const uint8_t *pImage, uint32_t width, uint32_t height);
+
+// Predicts the payload size uDoomEncoderEncode() would give for the image at a
+// fraction of the cost, by compressing a sample of its rows. Once a few frames
+// were encoded it is mostly within 10% for PNG, video deflate payloads depend
+// on the previous frame and are harder to predict. QOI payloads are cheap
+// enough to be encoded whole, the estimate is exact. Returns the lodepng error
+// code.
+uint32_t uDoomEncoderEstimate(uDoomEncoder_t *pEncoder, size_t *pSize,
+                              const uint8_t *pImage, uint32_t width, uint32_t height);
+
+// Accounts for a payload of height rows encoded by another encoder of the
+// same stream, such as one per worker thread, in the estimates of this one.
+// Not for the payloads of this encoder: uDoomEncoderEncode() learns those
+// itself, a second call would count them twice.
+void uDoomEncoderLearn(uDoomEncoder_t *pEncoder, size_t payloadSize, uint32_t height);
+
+// Frame header flags describing the payloads
+uint8_t uDoomEncoderGetFrameFlags(const uDoomEncoder_t *pEncoder);
+
+// The next video deflate frame won't depend on the previous one, call it when
+// the remote may have missed a frame
+void uDoomEncoderRequestKeyframe(uDoomEncoder_t *pEncoder);
@@ -0,0 +1,93 @@
+#include <string.h>
+#include "ubx_doom_fec.h"
+
+static void sendWithHeader(uDoomFec_t *pFec, uint8_t index, uint8_t count, uint16_t length,
+                           const uint8_t *pData, size_t size)
+{
+    uint8_t *p = pFec->packet;
+
+    *p++ = 0xFE;
+    *p++ = 0xC0;
+    *p++ = pFec->group;
+    *p++ = index;
+    *p++ = (uint8_t)((count << 4) | pFec->m);
+    *p++ = (uint8_t)(length >> 8);
+    *p++ = (uint8_t)length;
+    memcpy(p, pData, size);
+
+    pFec->pSend(pFec->packet, U_DOOM_FEC_HEADER_SIZE + size, pFec->pContext);
+}
+
+void uDoomFecInit(uDoomFec_t *pFec, uint32_t k, uint32_t m, uDoomPacketSend_t pSend, void *pContext)
+{
+    k = (k < 1) ? 1 : (k > U_DOOM_FEC_MAX_PACKETS) ? U_DOOM_FEC_MAX_PACKETS : k;
+    m = (m < 1) ? 1 : (m > k) ? k : m;
+
+    pFec->k = k;
+    pFec->m = m;
+    pFec->group = 0;
+    pFec->count = 0;
+    memset(pFec->paritySize, 0, sizeof(pFec->paritySize));
+    memset(pFec->parityLength, 0, sizeof(pFec->parityLength));
+    pFec->pSend = pSend;
+    pFec->pContext = pContext;
+    pFec->dataPacketsSent = 0;
+    pFec->parityPacketsSent = 0;
+}
+
+void uDoomFecSend(const uint8_t *pData, size_t size, void *pContext)
+{
+    uDoomFec_t *pFec = (uDoomFec_t *)pContext;
+    uint32_t j = pFec->count % pFec->m;
+    uint8_t *pParity = pFec->parity[j];
+
+    if (size > U_DOOM_PACKET_MAX_SIZE) {
+        size = U_DOOM_PACKET_MAX_SIZE;
+    }
+
+    // The data goes out right away, only the parity waits for the group
+    sendWithHeader(pFec, (uint8_t)pFec->count, (uint8_t)pFec->k, (uint16_t)size, pData, size);
+    ++pFec->dataPacketsSent;
+
+    if (size > pFec->paritySize[j]) {
+        memset(&pParity[pFec->paritySize[j]], 0, size - pFec->paritySize[j]);
+        pFec->paritySize[j] = size;
+    }
+    for (size_t i = 0; i < size; ++i) {
+        pParity[i] ^= pData[i];
+    }
+    pFec->parityLength[j] ^= (uint16_t)size;
+
+    if (++pFec->count == pFec->k) {
+        uDoomFecFlush(pFec);
+    }
+}
+
+void uDoomFecFlush(uDoomFec_t *pFec)
+{
+    if (pFec->count == 0) {
+        return;
+    }
+
+    for (uint32_t j = 0; (j < pFec->m) && (j < pFec->count); ++j) {
+        sendWithHeader(pFec, (uint8_t)(j | U_DOOM_FEC_PARITY_FLAG), (uint8_t)pFec->count,
+                       pFec->parityLength[j], pFec->parity[j], pFec->paritySize[j]);
+        ++pFec->parityPacketsSent;
+        pFec->paritySize[j] = 0;
+        pFec->parityLength[j] = 0;
+    }
+
+    ++pFec->group;
+    pFec->count = 0;
+}
+
+uint32_t uDoomFecGetOverhead(const uDoomFec_t *pFec)
+{
+    uint32_t overhead = 0;
+
+    if (pFec->dataPacketsSent > 0) {
+        overhead = (uint32_t)(((uint64_t)pFec->parityPacketsSent * 100) / pFec->dataPacketsSent);
+    }
+
+    return overhead;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "ubx_doom_frame.h"
+
+// Forward error correction over the packets the packetizer sends. Every K data
+// packets are followed by M parity packets, parity j being the XOR of the data
+// packets i of the group with i % M == j. The receiver can then rebuild one
+// lost packet per parity, which covers a burst of up to M packets lost in a
+// row.
+//
+// Every packet starts with a header, all fields big endian:
+// [0xFEC0][GROUP (8 bit)][INDEX (8 bit)][COUNT (4 bit)|M (4 bit)][LENGTH (16 bit)]
+// Data packets: INDEX in the group, COUNT = K, LENGTH of the data after the
+// header. Parity packets: INDEX = j | U_DOOM_FEC_PARITY_FLAG, COUNT = number of
+// data packets in the group, fewer than K if it was flushed early, LENGTH = XOR
+// of the lengths of the data packets it covers. The parity data is the XOR of
+// those packets, padded with zeros to the longest.
+#define U_DOOM_FEC_HEADER_SIZE      7
+#define U_DOOM_FEC_MAX_PACKETS      15
+#define U_DOOM_FEC_PARITY_FLAG      0x80
+
+typedef struct uDoomFec {
+    uint32_t k;
+    uint32_t m;
+    uint8_t group;
+    uint32_t count;
+    uint8_t parity[U_DOOM_FEC_MAX_PACKETS][U_DOOM_PACKET_MAX_SIZE];
+    size_t paritySize[U_DOOM_FEC_MAX_PACKETS];
+    uint16_t parityLength[U_DOOM_FEC_MAX_PACKETS];
+    uint8_t packet[U_DOOM_FEC_HEADER_SIZE + U_DOOM_PACKET_MAX_SIZE];
+    uDoomPacketSend_t pSend;
+    void *pContext;
+    uint32_t dataPacketsSent;
+    uint32_t parityPacketsSent;
+} uDoomFec_t;
+
+// k and m are clamped to 1..U_DOOM_FEC_MAX_PACKETS, m to at most k. The
+// packets given to uDoomFecSend() must leave room for the header within the
+// MTU, at most U_DOOM_PACKET_MAX_SIZE.
+void uDoomFecInit(uDoomFec_t *pFec, uint32_t k, uint32_t m, uDoomPacketSend_t pSend, void *pContext);
+
+// Has the signature of uDoomPacketSend_t, pContext being the uDoomFec_t, so it
+// can be given to uDoomPacketizerInit()
+void uDoomFecSend(const uint8_t *pData, size_t size, void *pContext);
+
+// Sends the parity of a group that isn't complete yet, call it with the
+// packetizer flush so the last packets don't wait for the next frame
+void uDoomFecFlush(uDoomFec_t *pFec);
+
+// Parity packets sent per 100 data packets
+uint32_t uDoomFecGetOverhead(const uDoomFec_t *pFec);
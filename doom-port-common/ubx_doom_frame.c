@@ -0,0 +1,150 @@
+#include <string.h>
+#include "lodepng.h"
+#include "ubx_doom_frame.h"
+
+static const uint8_t gStartOfFrame[] = {0xCA, 0xFE, 0xBA, 0xBE};
+static const uint8_t gEndOfFrame[] = {0xDE, 0xAD, 0xBE, 0xEF};
+
+static uint8_t *put16(uint8_t *p, uint16_t value)
+{
+    *p++ = (uint8_t)(value >> 8);
+    *p++ = (uint8_t)value;
+    return p;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t value)
+{
+    *p++ = (uint8_t)(value >> 24);
+    *p++ = (uint8_t)(value >> 16);
+    *p++ = (uint8_t)(value >> 8);
+    *p++ = (uint8_t)value;
+    return p;
+}
+
+size_t uDoomFrameWriteHeader(uint8_t *pBuffer, const uDoomFrameHeader_t *pHeader)
+{
+    uint8_t *p = pBuffer;
+    uint8_t headerSize = U_DOOM_FRAME_HEADER_SIZE;
+
+    if (pHeader->flags & U_DOOM_FRAME_FLAG_LATENCY_ECHO) {
+        headerSize += 8;
+    }
+
+    for (size_t i = 0; i < sizeof(gStartOfFrame); ++i) {
+        *p++ = gStartOfFrame[i];
+    }
+    p = put32(p, pHeader->payloadSize);
+    *p++ = U_DOOM_FRAME_VERSION;
+    *p++ = headerSize;
+    p = put16(p, pHeader->sequence);
+    *p++ = pHeader->flags;
+    *p++ = pHeader->pass;
+    p = put16(p, pHeader->width);
+    p = put16(p, pHeader->height);
+    p = put16(p, pHeader->yOffset);
+    p = put16(p, pHeader->frameHeight);
+    if (pHeader->flags & U_DOOM_FRAME_FLAG_LATENCY_ECHO) {
+        p = put16(p, pHeader->echoId);
+        p = put16(p, pHeader->echoDwellMs);
+        p = put32(p, pHeader->echoSentMs);
+    }
+
+    return (size_t)(p - pBuffer);
+}
+
+size_t uDoomFrameWriteTrailer(uint8_t *pBuffer, const uint8_t *pPayload, size_t payloadSize)
+{
+    uint8_t *p = pBuffer;
+
+    for (size_t i = 0; i < sizeof(gEndOfFrame); ++i) {
+        *p++ = gEndOfFrame[i];
+    }
+    p = put32(p, lodepng_crc32(pPayload, payloadSize));
+
+    return (size_t)(p - pBuffer);
+}
+
+static void sendPacket(uDoomPacketizer_t *pPacketizer, const uint8_t *pData, size_t size)
+{
+    pPacketizer->pSend(pData, size, pPacketizer->pContext);
+    ++pPacketizer->packetsSent;
+    pPacketizer->bytesSent += (uint32_t)size;
+}
+
+void uDoomPacketizerInit(uDoomPacketizer_t *pPacketizer, size_t mtu, size_t overhead,
+                         uDoomPacketSend_t pSend, void *pContext)
+{
+    // A packet of 0 bytes would never fill up
+    if (mtu < U_DOOM_PACKET_MIN_SIZE) {
+        mtu = U_DOOM_PACKET_MIN_SIZE;
+    }
+    mtu -= overhead;
+    pPacketizer->length = 0;
+    pPacketizer->mtu = (mtu > U_DOOM_PACKET_MAX_SIZE) ? U_DOOM_PACKET_MAX_SIZE : mtu;
+    pPacketizer->pSend = pSend;
+    pPacketizer->pContext = pContext;
+    pPacketizer->packetsSent = 0;
+    pPacketizer->bytesSent = 0;
+}
+
+void uDoomPacketizerWrite(uDoomPacketizer_t *pPacketizer, const uint8_t *pData, size_t size)
+{
+    size_t mtu = pPacketizer->mtu;
+
+    // Top up the pending packet first
+    if (pPacketizer->length > 0) {
+        size_t count = mtu - pPacketizer->length;
+        if (count > size) {
+            count = size;
+        }
+        memcpy(&pPacketizer->buffer[pPacketizer->length], pData, count);
+        pPacketizer->length += count;
+        pData += count;
+        size -= count;
+        if (pPacketizer->length < mtu) {
+            return;
+        }
+        sendPacket(pPacketizer, pPacketizer->buffer, mtu);
+        pPacketizer->length = 0;
+    }
+
+    // Full packets go out straight from the caller's buffer
+    while (size >= mtu) {
+        sendPacket(pPacketizer, pData, mtu);
+        pData += mtu;
+        size -= mtu;
+    }
+
+    memcpy(pPacketizer->buffer, pData, size);
+    pPacketizer->length = size;
+}
+
+void uDoomPacketizerFlush(uDoomPacketizer_t *pPacketizer)
+{
+    if (pPacketizer->length > 0) {
+        sendPacket(pPacketizer, pPacketizer->buffer, pPacketizer->length);
+        pPacketizer->length = 0;
+    }
+}
+
+uint32_t uDoomPacketizerGetEfficiency(const uDoomPacketizer_t *pPacketizer)
+{
+    uint32_t efficiency = 0;
+
+    if (pPacketizer->packetsSent > 0) {
+        efficiency = (uint32_t)(((uint64_t)pPacketizer->bytesSent * 100) /
+                                ((uint64_t)pPacketizer->packetsSent * pPacketizer->mtu));
+    }
+
+    return efficiency;
+}
+
+void uDoomFrameParseAck(uDoomAck_t *pAck, const uint8_t *pData)
+{
+    // pData points past the 0xFEED header
+    pAck->framesReceived = ((uint32_t)pData[0] << 24) | ((uint32_t)pData[1] << 16) |
+                           ((uint32_t)pData[2] << 8) | (uint32_t)pData[3];
+    pAck->framesDropped = ((uint32_t)pData[4] << 24) | ((uint32_t)pData[5] << 16) |
+                          ((uint32_t)pData[6] << 8) | (uint32_t)pData[7];
+    pAck->lastSequence = (uint16_t)((pData[8] << 8) | pData[9]);
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Frame format:
+// [HEADER][PAYLOAD][TRAILER]
+//
+// Header, all fields big endian:
+// [0xCAFEBABE][PAYLOAD SIZE (32 bit)][VERSION (8 bit)][HEADER SIZE (8 bit)]
+// [SEQUENCE (16 bit)][FLAGS (8 bit)][PASS (8 bit)][WIDTH (16 bit)][HEIGHT (16 bit)]
+// [Y OFFSET (16 bit)][FRAME HEIGHT (16 bit)]
+// followed, if U_DOOM_FRAME_FLAG_LATENCY_ECHO is set, by
+// [LAST CONSUMED KEY ID (16 bit)][PORT DWELL MS (16 bit)][KEY SEND TIME MS (32 bit)]
+// The header size lets a receiver skip fields added by later versions.
+// Width and height are those of the encoded image, which may be smaller than
+// the screen if a downscale was applied. The image may also be a band of rows
+// only, those that changed: it goes Y OFFSET rows down a frame of FRAME HEIGHT
+// rows, the rest of the frame staying as it was. A band may be sent as several
+// slices, each a frame of its own with its own Y OFFSET.
+//
+// If U_DOOM_FRAME_FLAG_ADAM7_PASS is set the payload only holds the pixels of
+// Adam7 pass PASS, 1 to 7, of the WIDTH x HEIGHT image, as an image of their
+// own: the pixels at x = X0 + k * DX, y = Y0 + m * DY, with X0, Y0, DX and DY
+// those of the pass in the PNG specification. The passes of an image follow
+// each other, PASS is 0 otherwise.
+//
+// If U_DOOM_FRAME_FLAG_VIDEO_DEFLATE is set the payload is not a PNG but:
+// [PALETTE SIZE (16 bit)][ZLIB STREAM]
+// The zlib stream holds PALETTE SIZE RGB triplets followed by the PNG filtered
+// scanlines of the image: palette indices, or RGB if PALETTE SIZE is 0.
+// Except for key frames the stream has FDICT set, the preset dictionary being
+// the first U_DOOM_VIDEO_REFERENCE_SIZE bytes of the previous frame's stream
+// contents. Matches at exactly that distance pick up the same pixels of the
+// previous frame, which is as far back as a deflate window reaches.
+//
+// If U_DOOM_FRAME_FLAG_VIDEO_QOI is set the payload is the image encoded as
+// described in ubx_doom_qoi.h.
+//
+// Trailer:
+// [0xDEADBEEF][CRC32 OF PAYLOAD (32 bit)]
+#define U_DOOM_FRAME_VERSION            5
+#define U_DOOM_FRAME_HEADER_SIZE        22
+#define U_DOOM_FRAME_HEADER_MAX_SIZE    (U_DOOM_FRAME_HEADER_SIZE + 8)
+#define U_DOOM_FRAME_TRAILER_SIZE       8
+
+#define U_DOOM_FRAME_FLAG_LATENCY_ECHO  0x01
+#define U_DOOM_FRAME_FLAG_VIDEO_DEFLATE 0x02
+#define U_DOOM_FRAME_FLAG_VIDEO_QOI     0x04
+#define U_DOOM_FRAME_FLAG_ADAM7_PASS    0x08
+
+// One less than the deflate window, a match can't reach a full window back
+#define U_DOOM_VIDEO_REFERENCE_SIZE     (32 * 1024 - 1)
+
+// Ack format, sent by the remote every now and then:
+// [0xFEED][FRAMES RECEIVED (32 bit)][FRAMES DROPPED (32 bit)][LAST SEQUENCE (16 bit)]
+#define U_DOOM_ACK_FRAME_SIZE           12
+
+// Largest notification payload the packetizer will build
+#define U_DOOM_PACKET_MAX_SIZE          512
+// Smallest notification payload BLE allows, with the default ATT MTU of 23
+#define U_DOOM_PACKET_MIN_SIZE          20
+
+typedef void (*uDoomPacketSend_t)(const uint8_t *pData, size_t size, void *pContext);
+
+// Packs consecutive frames back to back into MTU sized packets, so the tail
+// of a frame shares its packet with the header of the next one. The receiver
+// recovers the frame boundaries from the header length fields.
+typedef struct uDoomPacketizer {
+    uint8_t buffer[U_DOOM_PACKET_MAX_SIZE];
+    size_t length;
+    size_t mtu;
+    uDoomPacketSend_t pSend;
+    void *pContext;
+    uint32_t packetsSent;
+    uint32_t bytesSent;
+} uDoomPacketizer_t;
+
+typedef struct uDoomFrameHeader {
+    uint32_t payloadSize;
+    uint16_t sequence;
+    uint8_t flags;
+    uint8_t pass;
+    uint16_t width;
+    uint16_t height;
+    uint16_t yOffset;
+    uint16_t frameHeight;
+    uint16_t echoId;
+    uint16_t echoDwellMs;
+    uint32_t echoSentMs;
+} uDoomFrameHeader_t;
+
+typedef struct uDoomAck {
+    uint32_t framesReceived;
+    uint32_t framesDropped;
+    uint16_t lastSequence;
+} uDoomAck_t;
+
+// Returns the number of bytes written, at most U_DOOM_FRAME_HEADER_MAX_SIZE
+size_t uDoomFrameWriteHeader(uint8_t *pBuffer, const uDoomFrameHeader_t *pHeader);
+
+// Returns the number of bytes written, always U_DOOM_FRAME_TRAILER_SIZE
+size_t uDoomFrameWriteTrailer(uint8_t *pBuffer, const uint8_t *pPayload, size_t payloadSize);
+
+// mtu is the notification payload size the link reported, nothing bounds it
+// so below U_DOOM_PACKET_MIN_SIZE it falls back to that. pSend adds overhead
+// bytes to each packet within it, such as the FEC header, less than
+// U_DOOM_PACKET_MIN_SIZE.
+void uDoomPacketizerInit(uDoomPacketizer_t *pPacketizer, size_t mtu, size_t overhead,
+                         uDoomPacketSend_t pSend, void *pContext);
+
+// Only full packets are sent, what is left is kept for the next write
+void uDoomPacketizerWrite(uDoomPacketizer_t *pPacketizer, const uint8_t *pData, size_t size);
+
+// Sends the pending partial packet, if any
+void uDoomPacketizerFlush(uDoomPacketizer_t *pPacketizer);
+
+// Share of the packet capacity carrying data, in percent
+uint32_t uDoomPacketizerGetEfficiency(const uDoomPacketizer_t *pPacketizer);
+
+void uDoomFrameParseAck(uDoomAck_t *pAck, const uint8_t *pData);
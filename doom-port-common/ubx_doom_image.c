@@ -0,0 +1,196 @@
+#include <math.h>
+#include <string.h>
+#include "ubx_doom_image.h"
+
+// First column and row of each Adam7 pass and the steps between its pixels
+static const uint8_t gAdam7[U_DOOM_IMAGE_ADAM7_PASSES][4] = {
+    {0, 0, 8, 8},
+    {4, 0, 8, 8},
+    {0, 4, 4, 8},
+    {2, 0, 4, 4},
+    {0, 2, 2, 4},
+    {1, 0, 2, 2},
+    {0, 1, 1, 2}
+};
+
+// log2 of the horizontal and vertical decimation factors of each scale
+static const uint8_t gScaleShift[U_DOOM_SCALE_MAX_NUM][2] = {
+    {0, 0},
+    {1, 1},
+    {2, 2},
+    {0, 1}
+};
+
+uDoomScale_t uDoomImageScaleFromName(const char *pName)
+{
+    uDoomScale_t scale = U_DOOM_SCALE_MAX_NUM;
+
+    if (strcmp(pName, "1") == 0) {
+        scale = U_DOOM_SCALE_FULL;
+    } else if (strcmp(pName, "2") == 0) {
+        scale = U_DOOM_SCALE_HALF;
+    } else if (strcmp(pName, "4") == 0) {
+        scale = U_DOOM_SCALE_QUARTER;
+    } else if (strcmp(pName, "anamorphic") == 0) {
+        scale = U_DOOM_SCALE_ANAMORPHIC;
+    }
+
+    return scale;
+}
+
+uDoomScale_t uDoomImageGetSmallerScale(uDoomScale_t scale)
+{
+    uDoomScale_t smaller = U_DOOM_SCALE_MAX_NUM;
+
+    switch (scale) {
+    case U_DOOM_SCALE_FULL:
+    case U_DOOM_SCALE_ANAMORPHIC:
+        smaller = U_DOOM_SCALE_HALF;
+        break;
+    case U_DOOM_SCALE_HALF:
+        smaller = U_DOOM_SCALE_QUARTER;
+        break;
+    default:
+        break;
+    }
+
+    return smaller;
+}
+
+void uDoomImageGetScaledSize(uDoomScale_t scale, uint32_t width, uint32_t height,
+                             uint32_t *pScaledWidth, uint32_t *pScaledHeight)
+{
+    *pScaledWidth = width >> gScaleShift[scale][0];
+    *pScaledHeight = height >> gScaleShift[scale][1];
+}
+
+void uDoomImageConvert(uint8_t *pOut, const uint32_t *pScreen, uint32_t width,
+                       uint32_t height, uDoomScale_t scale)
+{
+    uint32_t xShift = gScaleShift[scale][0];
+    uint32_t yShift = gScaleShift[scale][1];
+    uint32_t shift = xShift + yShift;
+    uint32_t outWidth = width >> xShift;
+    uint32_t outHeight = height >> yShift;
+
+    if (shift == 0) {
+        // Plain XRGB -> RGBA swizzle
+        for (uint32_t i = 0; i < width * height; ++i) {
+            uint32_t pixel = pScreen[i];
+            pOut[0] = (uint8_t)(pixel >> 16);
+            pOut[1] = (uint8_t)(pixel >> 8);
+            pOut[2] = (uint8_t)pixel;
+            pOut[3] = 0xFF;
+            pOut += 4;
+        }
+        return;
+    }
+
+    // Box filter. Red and blue are summed in the same word, with at most 16
+    // samples per output pixel neither lane can overflow into the other.
+    for (uint32_t y = 0; y < outHeight; ++y) {
+        const uint32_t *pRow = &pScreen[(y << yShift) * width];
+        for (uint32_t x = 0; x < outWidth; ++x) {
+            const uint32_t *pBlock = &pRow[x << xShift];
+            uint32_t sumRb = 0;
+            uint32_t sumG = 0;
+            for (uint32_t dy = 0; dy < (1u << yShift); ++dy) {
+                for (uint32_t dx = 0; dx < (1u << xShift); ++dx) {
+                    uint32_t pixel = pBlock[dy * width + dx];
+                    sumRb += pixel & 0x00FF00FF;
+                    sumG += pixel & 0x0000FF00;
+                }
+            }
+            sumRb = (sumRb >> shift) & 0x00FF00FF;
+            sumG = (sumG >> shift) & 0x0000FF00;
+            pOut[0] = (uint8_t)(sumRb >> 16);
+            pOut[1] = (uint8_t)(sumG >> 8);
+            pOut[2] = (uint8_t)sumRb;
+            pOut[3] = 0xFF;
+            pOut += 4;
+        }
+    }
+}
+
+void uDoomImageConvertRows(uint8_t *pOut, const uint32_t *pScreen, uint32_t width,
+                           uint32_t height, uDoomScale_t scale, uint32_t firstRow,
+                           uint32_t endRow, uint32_t *pY, uint32_t *pHeight)
+{
+    uint32_t yShift = gScaleShift[scale][1];
+    uint32_t blockMask = (1u << yShift) - 1;
+
+    firstRow &= ~blockMask;
+    endRow = (endRow + blockMask) & ~blockMask;
+    if (endRow > height) {
+        endRow = height;
+    }
+
+    *pY = firstRow >> yShift;
+    *pHeight = (endRow >> yShift) - *pY;
+    uDoomImageConvert(pOut, &pScreen[firstRow * width], width, *pHeight << yShift, scale);
+}
+
+bool uDoomImageFindDirtyRows(const uint32_t *pScreen, const uint32_t *pPrevious,
+                             uint32_t width, uint32_t height,
+                             uint32_t *pFirstRow, uint32_t *pEndRow)
+{
+    size_t rowBytes = width * sizeof(uint32_t);
+    uint32_t first = 0;
+    uint32_t end = height;
+
+    // memcmp() is vectorized by the C library, which beats comparing words here
+    while ((first < height) && (memcmp(&pScreen[first * width], &pPrevious[first * width], rowBytes) == 0)) {
+        ++first;
+    }
+    if (first == height) {
+        return false;
+    }
+    while (memcmp(&pScreen[(end - 1) * width], &pPrevious[(end - 1) * width], rowBytes) == 0) {
+        --end;
+    }
+
+    *pFirstRow = first;
+    *pEndRow = end;
+
+    return true;
+}
+
+float uDoomImageGetPsnr(const uint8_t *pImage, const uint8_t *pReference, uint32_t width, uint32_t height)
+{
+    size_t samples = (size_t)width * height * 3;
+    uint64_t squares = 0;
+
+    for (size_t i = 0; i < (size_t)width * height * 4; i += 4) {
+        for (uint32_t c = 0; c < 3; ++c) {
+            int32_t d = (int32_t)pImage[i + c] - pReference[i + c];
+            squares += (uint64_t)(d * d);
+        }
+    }
+    if (squares == 0) {
+        return U_DOOM_IMAGE_PSNR_IDENTICAL;
+    }
+
+    return 10.0F * log10f(255.0F * 255.0F * (float)samples / (float)squares);
+}
+
+void uDoomImageGetAdam7PassSize(uint32_t pass, uint32_t width, uint32_t height,
+                                uint32_t *pPassWidth, uint32_t *pPassHeight)
+{
+    const uint8_t *pAdam7 = gAdam7[pass];
+
+    *pPassWidth = (width > pAdam7[0]) ? (width - pAdam7[0] + pAdam7[2] - 1) / pAdam7[2] : 0;
+    *pPassHeight = (height > pAdam7[1]) ? (height - pAdam7[1] + pAdam7[3] - 1) / pAdam7[3] : 0;
+}
+
+void uDoomImageGetAdam7Pass(uint8_t *pOut, const uint8_t *pImage, uint32_t width,
+                            uint32_t height, uint32_t pass)
+{
+    const uint8_t *pAdam7 = gAdam7[pass];
+
+    for (uint32_t y = pAdam7[1]; y < height; y += pAdam7[3]) {
+        for (uint32_t x = pAdam7[0]; x < width; x += pAdam7[2]) {
+            memcpy(pOut, &pImage[((size_t)y * width + x) * 4], 4);
+            pOut += 4;
+        }
+    }
+}
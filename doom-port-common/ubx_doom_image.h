@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Number of Adam7 interlacing passes
+#define U_DOOM_IMAGE_ADAM7_PASSES   7
+
+// What uDoomImageGetPsnr() gives for identical images
+#define U_DOOM_IMAGE_PSNR_IDENTICAL 99.0F
+
+// Output scales applied before encoding, the receiver scales back up to
+// the full screen size
+typedef enum {
+    U_DOOM_SCALE_FULL = 0,      // 1/1, e.g. 320x200
+    U_DOOM_SCALE_HALF,          // 1/2, e.g. 160x100
+    U_DOOM_SCALE_QUARTER,       // 1/4, e.g. 80x50
+    U_DOOM_SCALE_ANAMORPHIC,    // Full width, half height, e.g. 320x100
+    U_DOOM_SCALE_MAX_NUM
+} uDoomScale_t;
+
+// Accepts "1", "2", "4" and "anamorphic", returns U_DOOM_SCALE_MAX_NUM otherwise
+uDoomScale_t uDoomImageScaleFromName(const char *pName);
+
+// The next scale down to fall back to, U_DOOM_SCALE_MAX_NUM after the smallest
+uDoomScale_t uDoomImageGetSmallerScale(uDoomScale_t scale);
+
+void uDoomImageGetScaledSize(uDoomScale_t scale, uint32_t width, uint32_t height,
+                             uint32_t *pScaledWidth, uint32_t *pScaledHeight);
+
+// Converts the XRGB screen buffer into RGBA, box filtering it down to the
+// given scale in the same pass. pOut must hold scaled width * height * 4 bytes.
+void uDoomImageConvert(uint8_t *pOut, const uint32_t *pScreen, uint32_t width,
+                       uint32_t height, uDoomScale_t scale);
+
+// Same for the rows [firstRow, endRow) of the screen only, widened to whole
+// blocks of the scale. *pY and *pHeight get where the band lands in the
+// scaled image and its height.
+void uDoomImageConvertRows(uint8_t *pOut, const uint32_t *pScreen, uint32_t width,
+                           uint32_t height, uDoomScale_t scale, uint32_t firstRow,
+                           uint32_t endRow, uint32_t *pY, uint32_t *pHeight);
+
+// Compares the screen with a copy of an earlier one, from the top down to the
+// first changed row and from the bottom up to the last, so the rows in between
+// are never read. Returns false if nothing changed, otherwise the changed rows
+// are [*pFirstRow, *pEndRow).
+bool uDoomImageFindDirtyRows(const uint32_t *pScreen, const uint32_t *pPrevious,
+                             uint32_t width, uint32_t height,
+                             uint32_t *pFirstRow, uint32_t *pEndRow);
+
+// Peak signal to noise ratio of an RGBA image against a reference, in dB,
+// over the color channels
+float uDoomImageGetPsnr(const uint8_t *pImage, const uint8_t *pReference, uint32_t width, uint32_t height);
+
+// Size of the image made of the pixels of Adam7 pass, 0 to 6, of a width x
+// height image. Either may be 0 for small images, the pass is empty then.
+void uDoomImageGetAdam7PassSize(uint32_t pass, uint32_t width, uint32_t height,
+                                uint32_t *pPassWidth, uint32_t *pPassHeight);
+
+// Copies the pixels of Adam7 pass, 0 to 6, of the RGBA image into pOut, an
+// image of the size uDoomImageGetAdam7PassSize() gives
+void uDoomImageGetAdam7Pass(uint8_t *pOut, const uint8_t *pImage, uint32_t width,
+                            uint32_t height, uint32_t pass);
@@ -0,0 +1,278 @@
+#include "doomkeys.h"
+#include "ubx_doom_atomic.h"
+#include "ubx_doom_frame.h"
+#include "ubx_doom_input.h"
+
+#define RING_MASK               (U_DOOM_INPUT_RING_SIZE - 1)
+// Acks come about once a second, the game thread takes them every frame
+#define ACK_RING_SIZE           4
+#define ACK_RING_MASK           (ACK_RING_SIZE - 1)
+
+// Single producer (BLE callback) / single consumer (game thread), so the
+// indexes only need acquire/release ordering, no locks.
+
+enum {
+    UP_KEY = 38,
+    DOWN_KEY = 40,
+    LEFT_KEY = 37,
+    RIGHT_KEY = 39,
+    CTRL_KEY = 17,
+    ENTER_KEY = 13,
+    SPACE_KEY = 32,
+    ESCAPE_KEY = 27
+};
+
+static const uint8_t gButtonFrameHeader[] = {0xAB, 0xCD};
+static const uint8_t gButtonFrameLatencyHeader[] = {0xAB, 0xCE};
+static const uint8_t gAckFrameHeader[] = {0xFE, 0xED};
+
+static uDoomInputEvent_t gRing[U_DOOM_INPUT_RING_SIZE];
+static uint32_t gHead = 0;      // Written by the producer only
+static uint32_t gTail = 0;      // Written by the consumer only
+static uint32_t gBatchEnd = 0;
+static bool gIsDraining = false;
+static uDoomInputEvent_t gLastStamped;
+static bool gHasLastStamped = false;
+
+// Handed over like the key events, the consumer only keeps the newest
+static uDoomAck_t gAckRing[ACK_RING_SIZE];
+static uint32_t gAckHead = 0;   // Written by the producer only
+static uint32_t gAckTail = 0;   // Written by the consumer only
+
+// Producer-only parse state
+static uint8_t gPartialFrame[U_DOOM_ACK_FRAME_SIZE];
+static size_t gPartialLength = 0;
+static size_t gExpectedLength = 0;
+
+// Every counter has a single writer, those of the producer are published
+// with U_DOOM_STORE_RELEASE() for the consumer to read
+static uint32_t gReceived = 0;
+static uint32_t gDropped = 0;
+static uint32_t gIgnoredBytes = 0;
+static uint32_t gConsumed = 0;
+static uint32_t gLastDwellMs = 0;
+static uint32_t gMaxDwellMs = 0;
+
+static uint8_t convertToDoomKey(uint8_t receivedKey)
+{
+    uint8_t key;
+
+    switch (receivedKey) {
+    case ENTER_KEY:
+        key = KEY_ENTER;
+        break;
+    case LEFT_KEY:
+        key = KEY_LEFTARROW;
+        break;
+    case RIGHT_KEY:
+        key = KEY_RIGHTARROW;
+        break;
+    case UP_KEY:
+        key = KEY_UPARROW;
+        break;
+    case DOWN_KEY:
+        key = KEY_DOWNARROW;
+        break;
+    case CTRL_KEY:
+        key = KEY_FIRE;
+        break;
+    case SPACE_KEY:
+        key = KEY_USE;
+        break;
+    case ESCAPE_KEY:
+        key = KEY_ESCAPE;
+        break;
+    default:
+        key = 0xFF;
+        break;
+    }
+
+    return key;
+}
+
+static bool push(const uDoomInputEvent_t *pEvent)
+{
+    uint32_t head = gHead;
+
+    if (head - U_DOOM_LOAD_ACQUIRE(&gTail) >= U_DOOM_INPUT_RING_SIZE) {
+        U_DOOM_STORE_RELEASE(&gDropped, gDropped + 1);
+        return false;
+    }
+
+    gRing[head & RING_MASK] = *pEvent;
+    U_DOOM_STORE_RELEASE(&gHead, head + 1);
+    U_DOOM_STORE_RELEASE(&gReceived, gReceived + 1);
+
+    return true;
+}
+
+void uDoomInputInit(void)
+{
+    gHead = 0;
+    gTail = 0;
+    gBatchEnd = 0;
+    gIsDraining = false;
+    gHasLastStamped = false;
+    gAckHead = 0;
+    gAckTail = 0;
+    gPartialLength = 0;
+    gExpectedLength = 0;
+    gReceived = 0;
+    gDropped = 0;
+    gIgnoredBytes = 0;
+    gConsumed = 0;
+    gLastDwellMs = 0;
+    gMaxDwellMs = 0;
+}
+
+static bool isFrameStart(uint8_t byte)
+{
+    return byte == gButtonFrameHeader[0] || byte == gAckFrameHeader[0];
+}
+
+static size_t getExpectedLength(uint8_t first, uint8_t second)
+{
+    size_t length = 0;
+
+    if (first == gButtonFrameHeader[0] && second == gButtonFrameHeader[1]) {
+        length = U_DOOM_KEY_FRAME_SIZE;
+    } else if (first == gButtonFrameLatencyHeader[0] && second == gButtonFrameLatencyHeader[1]) {
+        length = U_DOOM_KEY_FRAME_LATENCY_SIZE;
+    } else if (first == gAckFrameHeader[0] && second == gAckFrameHeader[1]) {
+        length = U_DOOM_ACK_FRAME_SIZE;
+    }
+
+    return length;
+}
+
+static size_t handleFrame(uint32_t nowMs)
+{
+    size_t queued = 0;
+
+    if (gPartialFrame[0] == gAckFrameHeader[0]) {
+        uint32_t head = gAckHead;
+        // With the ring full the consumer has yet to take the newest, which
+        // this one would only have superseded
+        if (head - U_DOOM_LOAD_ACQUIRE(&gAckTail) < ACK_RING_SIZE) {
+            uDoomFrameParseAck(&gAckRing[head & ACK_RING_MASK], &gPartialFrame[2]);
+            U_DOOM_STORE_RELEASE(&gAckHead, head + 1);
+        }
+    } else {
+        uDoomInputEvent_t event = {
+            .isPressed = gPartialFrame[2] != 0,
+            .key = convertToDoomKey(gPartialFrame[3]),
+            .receivedMs = nowMs
+        };
+        if (gExpectedLength == U_DOOM_KEY_FRAME_LATENCY_SIZE) {
+            event.hasId = true;
+            event.id = (uint16_t)((gPartialFrame[4] << 8) | gPartialFrame[5]);
+            event.sentMs = ((uint32_t)gPartialFrame[6] << 24) | ((uint32_t)gPartialFrame[7] << 16) |
+                           ((uint32_t)gPartialFrame[8] << 8) | (uint32_t)gPartialFrame[9];
+        }
+        if (push(&event)) {
+            ++queued;
+        }
+    }
+
+    return queued;
+}
+
+size_t uDoomInputParse(const uint8_t *pData, size_t length, uint32_t nowMs)
+{
+    size_t queued = 0;
+
+    for (size_t i = 0; i < length; ++i) {
+        uint8_t byte = pData[i];
+
+        // Resync on the two header bytes, anything else in between is noise
+        if (gPartialLength == 0 && !isFrameStart(byte)) {
+            U_DOOM_STORE_RELEASE(&gIgnoredBytes, gIgnoredBytes + 1);
+            continue;
+        }
+        if (gPartialLength == 1) {
+            gExpectedLength = getExpectedLength(gPartialFrame[0], byte);
+            if (gExpectedLength == 0) {
+                // Not a known frame after all, but this byte may start one
+                U_DOOM_STORE_RELEASE(&gIgnoredBytes, gIgnoredBytes + 1);
+                gPartialLength = 0;
+                if (!isFrameStart(byte)) {
+                    U_DOOM_STORE_RELEASE(&gIgnoredBytes, gIgnoredBytes + 1);
+                    continue;
+                }
+            }
+        }
+
+        gPartialFrame[gPartialLength++] = byte;
+        if (gPartialLength > 1 && gPartialLength == gExpectedLength) {
+            queued += handleFrame(nowMs);
+            gPartialLength = 0;
+        }
+    }
+
+    return queued;
+}
+
+bool uDoomInputPop(uDoomInputEvent_t *pEvent, uint32_t nowMs)
+{
+    uint32_t tail = gTail;
+
+    if (!gIsDraining) {
+        gBatchEnd = U_DOOM_LOAD_ACQUIRE(&gHead);
+        gIsDraining = true;
+    }
+
+    if (tail == gBatchEnd) {
+        // Batch exhausted, the next call starts a new tic
+        gIsDraining = false;
+        return false;
+    }
+
+    *pEvent = gRing[tail & RING_MASK];
+    U_DOOM_STORE_RELEASE(&gTail, tail + 1);
+
+    pEvent->consumedMs = nowMs;
+    if (pEvent->hasId) {
+        gLastStamped = *pEvent;
+        gHasLastStamped = true;
+    }
+
+    gLastDwellMs = nowMs - pEvent->receivedMs;
+    if (gLastDwellMs > gMaxDwellMs) {
+        gMaxDwellMs = gLastDwellMs;
+    }
+    ++gConsumed;
+
+    return true;
+}
+
+bool uDoomInputGetLastStamped(uDoomInputEvent_t *pEvent)
+{
+    if (gHasLastStamped) {
+        *pEvent = gLastStamped;
+    }
+
+    return gHasLastStamped;
+}
+
+bool uDoomInputGetAck(uDoomAck_t *pAck)
+{
+    uint32_t head = U_DOOM_LOAD_ACQUIRE(&gAckHead);
+    bool isNew = head != gAckTail;
+
+    if (isNew) {
+        *pAck = gAckRing[(head - 1) & ACK_RING_MASK];
+        U_DOOM_STORE_RELEASE(&gAckTail, head);
+    }
+
+    return isNew;
+}
+
+void uDoomInputGetStats(uDoomInputStats_t *pStats)
+{
+    pStats->received = U_DOOM_LOAD_ACQUIRE(&gReceived);
+    pStats->dropped = U_DOOM_LOAD_ACQUIRE(&gDropped);
+    pStats->ignoredBytes = U_DOOM_LOAD_ACQUIRE(&gIgnoredBytes);
+    pStats->consumed = gConsumed;
+    pStats->lastDwellMs = gLastDwellMs;
+    pStats->maxDwellMs = gMaxDwellMs;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "ubx_doom_frame.h"
+
+// Must be a power of two
+#define U_DOOM_INPUT_RING_SIZE  128
+
+// Button frame format:
+// [HEADER][PRESSED][KEY]
+#define U_DOOM_KEY_FRAME_SIZE   4
+// Latency-stamped button frame format, sent by clients measuring key-to-photon:
+// [HEADER][PRESSED][KEY][ID (16 bit BE)][SEND TIME MS (32 bit BE)]
+#define U_DOOM_KEY_FRAME_LATENCY_SIZE 10
+
+typedef struct uDoomInputEvent {
+    bool isPressed;
+    uint8_t key;
+    uint32_t receivedMs;
+    // Only valid if hasId, echoed back so the remote can compute the round trip
+    bool hasId;
+    uint16_t id;
+    uint32_t sentMs;
+    // Filled in by uDoomInputPop() with the time of the tic consuming it
+    uint32_t consumedMs;
+} uDoomInputEvent_t;
+
+typedef struct uDoomInputStats {
+    uint32_t received;
+    uint32_t consumed;
+    uint32_t dropped;
+    uint32_t ignoredBytes;
+    uint32_t lastDwellMs;
+    uint32_t maxDwellMs;
+} uDoomInputStats_t;
+
+void uDoomInputInit(void);
+
+// Producer side, called from the BLE receive callback only. Parses every
+// key and ack frame found in the buffer, a frame split across two calls is kept
+// and completed by the next one. Returns the number of events queued.
+size_t uDoomInputParse(const uint8_t *pData, size_t length, uint32_t nowMs);
+
+// Consumer side, called from the game thread only. The first call of a tic
+// takes a snapshot of what is pending and the following calls drain exactly
+// that batch, returning false once it is exhausted. Events arriving while a
+// batch is drained are left for the next tic.
+bool uDoomInputPop(uDoomInputEvent_t *pEvent, uint32_t nowMs);
+
+// Consumer side, returns the most recently consumed latency-stamped event,
+// false if the remote never sent one
+bool uDoomInputGetLastStamped(uDoomInputEvent_t *pEvent);
+
+// Consumer side, returns true if an ack arrived since the last call, the
+// newest one if several did
+bool uDoomInputGetAck(uDoomAck_t *pAck);
+
+// Consumer side, the counters of both sides. Each has a single writer, so
+// none is lost, though those of the producer may be a key behind.
+void uDoomInputGetStats(uDoomInputStats_t *pStats);
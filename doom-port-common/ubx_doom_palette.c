@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ubx_doom_palette.h"
+
+// A new palette must also save at least this much squared error per pixel,
+// or a scene the current palette covers almost exactly would still flicker
+#define MIN_GAIN_PER_PIXEL  16
+
+#define KEY(r, g, b) ((uint16_t)((((r) >> 3) << 10) | (((g) >> 3) << 5) | ((b) >> 3)))
+
+// Channel c of a key, back to 8 bits
+#define CHANNEL(key, c) (gExpand5[((key) >> (10 - (c) * 5)) & 0x1F])
+
+// Keys [start, end) of the histogram going to one palette color
+typedef struct uDoomPaletteBox {
+    size_t start;
+    size_t end;
+    uint32_t channel;
+    double score;
+} uDoomPaletteBox_t;
+
+static const uint8_t gBayer[4][4] = {
+    {0, 8, 2, 10},
+    {12, 4, 14, 6},
+    {3, 11, 1, 9},
+    {15, 7, 13, 5}
+};
+
+static const uint8_t gExpand5[32] = {
+    0, 8, 16, 24, 33, 41, 49, 57, 66, 74, 82, 90, 99, 107, 115, 123,
+    132, 140, 148, 156, 165, 173, 181, 189, 198, 206, 214, 222, 231, 239, 247, 255
+};
+
+static int compareRed(const void *pA, const void *pB)
+{
+    return (int)(*(const uint16_t *)pA >> 10) - (int)(*(const uint16_t *)pB >> 10);
+}
+
+static int compareGreen(const void *pA, const void *pB)
+{
+    return (int)((*(const uint16_t *)pA >> 5) & 0x1F) - (int)((*(const uint16_t *)pB >> 5) & 0x1F);
+}
+
+static int compareBlue(const void *pA, const void *pB)
+{
+    return (int)(*(const uint16_t *)pA & 0x1F) - (int)(*(const uint16_t *)pB & 0x1F);
+}
+
+static uint32_t getDistance(const uint8_t *pA, const uint8_t *pB)
+{
+    int32_t dr = (int32_t)pA[0] - pB[0];
+    int32_t dg = (int32_t)pA[1] - pB[1];
+    int32_t db = (int32_t)pA[2] - pB[2];
+
+    return (uint32_t)(dr * dr + dg * dg + db * db);
+}
+
+static void getKeyColor(uint16_t key, uint8_t *pColor)
+{
+    for (uint32_t c = 0; c < 3; ++c) {
+        pColor[c] = CHANNEL(key, c);
+    }
+}
+
+// Weighted spread of the box along its widest channel, which is where it gets
+// cut, and its mean color
+static void measureBox(const uDoomPalette_t *pPalette, uDoomPaletteBox_t *pBox, uint8_t *pMean)
+{
+    double sum[3] = {0.0, 0.0, 0.0};
+    double squares[3] = {0.0, 0.0, 0.0};
+    double weight = 0.0;
+
+    for (size_t i = pBox->start; i < pBox->end; ++i) {
+        uint16_t key = pPalette->keys[i];
+        double w = (double)pPalette->histogram[key];
+        for (uint32_t c = 0; c < 3; ++c) {
+            double v = CHANNEL(key, c);
+            sum[c] += w * v;
+            squares[c] += w * v * v;
+        }
+        weight += w;
+    }
+
+    pBox->score = -1.0;
+    for (uint32_t c = 0; c < 3; ++c) {
+        double spread = squares[c] - sum[c] * sum[c] / weight;
+        if (spread > pBox->score) {
+            pBox->score = spread;
+            pBox->channel = c;
+        }
+        pMean[c] = (uint8_t)(sum[c] / weight + 0.5);
+    }
+    if (pBox->end - pBox->start < 2) {
+        // Nothing left to cut
+        pBox->score = -1.0;
+    }
+}
+
+// Median cut over the colors of the histogram, the box with the largest
+// weighted spread being cut at its weighted median every time
+static uint32_t buildPalette(uDoomPalette_t *pPalette, uint8_t colors[][3], uint32_t numColors)
+{
+    static int (*const compare[3])(const void *, const void *) = {compareRed, compareGreen, compareBlue};
+    uDoomPaletteBox_t boxes[U_DOOM_PALETTE_MAX_COLORS];
+    uint32_t numBoxes = 1;
+
+    boxes[0].start = 0;
+    boxes[0].end = pPalette->numKeys;
+    measureBox(pPalette, &boxes[0], colors[0]);
+
+    while (numBoxes < numColors) {
+        uDoomPaletteBox_t *pBox = &boxes[0];
+        uint64_t half = 0;
+        uint64_t weight = 0;
+        size_t cut;
+
+        for (uint32_t i = 1; i < numBoxes; ++i) {
+            if (boxes[i].score > pBox->score) {
+                pBox = &boxes[i];
+            }
+        }
+        if (pBox->score < 0.0) {
+            break;
+        }
+
+        qsort(&pPalette->keys[pBox->start], pBox->end - pBox->start, sizeof(uint16_t),
+              compare[pBox->channel]);
+        for (size_t i = pBox->start; i < pBox->end; ++i) {
+            half += pPalette->histogram[pPalette->keys[i]];
+        }
+        half /= 2;
+        for (cut = pBox->start + 1; cut < pBox->end - 1; ++cut) {
+            weight += pPalette->histogram[pPalette->keys[cut - 1]];
+            if (weight >= half) {
+                break;
+            }
+        }
+
+        boxes[numBoxes].start = cut;
+        boxes[numBoxes].end = pBox->end;
+        pBox->end = cut;
+        measureBox(pPalette, pBox, colors[pBox - boxes]);
+        measureBox(pPalette, &boxes[numBoxes], colors[numBoxes]);
+        ++numBoxes;
+    }
+
+    return numBoxes;
+}
+
+// Squared error of the histogram mapped to its nearest colors, dithering aside
+static uint64_t getError(const uDoomPalette_t *pPalette, const uint8_t colors[][3], uint32_t numColors)
+{
+    uint64_t error = 0;
+
+    for (size_t i = 0; i < pPalette->numKeys; ++i) {
+        uint16_t key = pPalette->keys[i];
+        uint8_t color[3];
+        uint32_t nearest = UINT32_MAX;
+
+        getKeyColor(key, color);
+        for (uint32_t j = 0; j < numColors; ++j) {
+            uint32_t distance = getDistance(color, colors[j]);
+            if (distance < nearest) {
+                nearest = distance;
+            }
+        }
+        error += (uint64_t)nearest * pPalette->histogram[key];
+    }
+
+    return error;
+}
+
+// Nearest and second nearest palette colors of the key, and the share of the
+// second along the line between them in sixteenths
+static void makeMix(uDoomPalette_t *pPalette, uint16_t key)
+{
+    uint8_t *pMix = pPalette->mix[key];
+    uint8_t color[3];
+    uint32_t first = UINT32_MAX;
+    uint32_t second = UINT32_MAX;
+    int32_t dot = 0;
+    int32_t length = 0;
+
+    getKeyColor(key, color);
+    pMix[0] = 0;
+    pMix[1] = 0;
+    for (uint32_t i = 0; i < pPalette->numColors; ++i) {
+        uint32_t distance = getDistance(color, pPalette->colors[i]);
+        if (distance < first) {
+            second = first;
+            pMix[1] = pMix[0];
+            first = distance;
+            pMix[0] = (uint8_t)i;
+        } else if (distance < second) {
+            second = distance;
+            pMix[1] = (uint8_t)i;
+        }
+    }
+
+    for (uint32_t c = 0; c < 3; ++c) {
+        int32_t step = (int32_t)pPalette->colors[pMix[1]][c] - pPalette->colors[pMix[0]][c];
+        dot += ((int32_t)color[c] - pPalette->colors[pMix[0]][c]) * step;
+        length += step * step;
+    }
+    dot = (dot < 0) ? 0 : (dot > length) ? length : dot;
+    pMix[2] = (length > 0) ? (uint8_t)((dot * 16 + length / 2) / length) : 0;
+
+    pPalette->hasMix[key >> 3] |= (uint8_t)(1 << (key & 7));
+}
+
+void uDoomPaletteInit(uDoomPalette_t *pPalette)
+{
+    pPalette->numColors = 0;
+    pPalette->targetColors = 0;
+    pPalette->changes = 0;
+    memset(pPalette->histogram, 0, sizeof(pPalette->histogram));
+    pPalette->numKeys = 0;
+    memset(pPalette->hasMix, 0, sizeof(pPalette->hasMix));
+}
+
+void uDoomPaletteReduce(uDoomPalette_t *pPalette, uint8_t *pImage, uint32_t width,
+                        uint32_t height, uint32_t yOffset, uint32_t numColors)
+{
+    uint8_t colors[U_DOOM_PALETTE_MAX_COLORS][3];
+    size_t pixels = (size_t)width * height;
+    uint8_t *p = pImage;
+    uint32_t built;
+    bool isBetter;
+
+    numColors = (numColors < 2) ? 2 : (numColors > U_DOOM_PALETTE_MAX_COLORS) ?
+                U_DOOM_PALETTE_MAX_COLORS : numColors;
+
+    for (size_t i = 0; i < pPalette->numKeys; ++i) {
+        pPalette->histogram[pPalette->keys[i]] = 0;
+    }
+    pPalette->numKeys = 0;
+    for (size_t i = 0; i < pixels; ++i, p += 4) {
+        uint16_t key = KEY(p[0], p[1], p[2]);
+        if (pPalette->histogram[key]++ == 0) {
+            pPalette->keys[pPalette->numKeys++] = key;
+        }
+    }
+    if (pPalette->numKeys == 0) {
+        return;
+    }
+
+    // The current palette stays unless the scene moved away from it. It may
+    // have fewer colors than asked for if the scene had fewer.
+    built = buildPalette(pPalette, colors, numColors);
+    if (numColors != pPalette->targetColors) {
+        isBetter = true;
+    } else {
+        uint64_t current = getError(pPalette, pPalette->colors, pPalette->numColors);
+        uint64_t fresh = getError(pPalette, colors, built);
+        isBetter = (current * 100 > fresh * (100 + U_DOOM_PALETTE_HYSTERESIS_PERCENT)) &&
+                   (current - fresh > (uint64_t)pixels * MIN_GAIN_PER_PIXEL);
+    }
+    if (isBetter) {
+        memcpy(pPalette->colors, colors, built * 3);
+        pPalette->numColors = built;
+        pPalette->targetColors = numColors;
+        memset(pPalette->hasMix, 0, sizeof(pPalette->hasMix));
+        ++pPalette->changes;
+    }
+
+    p = pImage;
+    for (uint32_t y = 0; y < height; ++y) {
+        const uint8_t *pBayer = gBayer[(y + yOffset) & 3];
+        for (uint32_t x = 0; x < width; ++x, p += 4) {
+            uint16_t key = KEY(p[0], p[1], p[2]);
+            const uint8_t *pMix = pPalette->mix[key];
+            if (!(pPalette->hasMix[key >> 3] & (1 << (key & 7)))) {
+                makeMix(pPalette, key);
+            }
+            memcpy(p, pPalette->colors[(pBayer[x & 3] < pMix[2]) ? pMix[1] : pMix[0]], 3);
+            p[3] = 0xFF;
+        }
+    }
+}
+
+uint32_t uDoomPaletteGetChanges(const uDoomPalette_t *pPalette)
+{
+    return pPalette->changes;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Lossy stage before encoding, for links that can't carry the full palette:
+// the image is mapped to a small adaptive palette with ordered dithering. PNG
+// then stores it with 4 bit indices for 16 colors, 8 bit for more, and deflate
+// finds a lot more matches either way.
+//
+// The palette is built per scene by a median cut over the colors of the
+// image. It is only replaced when the new one would be clearly better, by
+// U_DOOM_PALETTE_HYSTERESIS_PERCENT, so small changes of the scene don't make
+// the colors flicker from one frame to the next.
+//
+// Colors are looked up with 5 bits per channel. Each one is dithered between
+// its two nearest palette colors with a 4x4 Bayer matrix, which costs a table
+// lookup and a compare per pixel.
+#define U_DOOM_PALETTE_MAX_COLORS           32
+#define U_DOOM_PALETTE_HYSTERESIS_PERCENT   25
+
+#define U_DOOM_PALETTE_KEY_BITS             15
+#define U_DOOM_PALETTE_KEYS                 (1 << U_DOOM_PALETTE_KEY_BITS)
+
+typedef struct uDoomPalette {
+    uint32_t numColors;
+    // Asked for, numColors may be fewer
+    uint32_t targetColors;
+    uint8_t colors[U_DOOM_PALETTE_MAX_COLORS][3];
+    uint32_t changes;
+    // Histogram of the image being reduced and the colors it has
+    uint32_t histogram[U_DOOM_PALETTE_KEYS];
+    uint16_t keys[U_DOOM_PALETTE_KEYS];
+    size_t numKeys;
+    // For every color seen since the palette changed: nearest palette color,
+    // second nearest and how many of the 16 dither thresholds pick the second
+    uint8_t mix[U_DOOM_PALETTE_KEYS][3];
+    uint8_t hasMix[U_DOOM_PALETTE_KEYS / 8];
+} uDoomPalette_t;
+
+void uDoomPaletteInit(uDoomPalette_t *pPalette);
+
+// Reduces the opaque RGBA image in place to numColors colors, 2 to
+// U_DOOM_PALETTE_MAX_COLORS. yOffset is where the image starts in the frame,
+// so the dither pattern of bands and slices lines up.
+void uDoomPaletteReduce(uDoomPalette_t *pPalette, uint8_t *pImage, uint32_t width,
+                        uint32_t height, uint32_t yOffset, uint32_t numColors);
+
+// Number of times a new palette was adopted
+uint32_t uDoomPaletteGetChanges(const uDoomPalette_t *pPalette);
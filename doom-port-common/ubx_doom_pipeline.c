@@ -0,0 +1,731 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "doomgeneric.h"
+#include "lodepng.h"
+#include "ubx_doom_arena.h"
+#include "ubx_doom_atomic.h"
+#include "ubx_doom_clock.h"
+#include "ubx_doom_fec.h"
+#include "ubx_doom_input.h"
+#include "ubx_doom_palette.h"
+#include "ubx_doom_pipeline.h"
+#include "ubx_doom_pool.h"
+#include "ubx_doom_qoi.h"
+
+// X * Y * 4 (RGBA size)
+#define DOOM_FRAME_SIZE         (DOOMGENERIC_RESX * DOOMGENERIC_RESY * 4)
+#define CODEC_BENCH_FRAMES      100
+// The link budget tries fewer colors down to this many before downscaling
+#define BUDGET_MIN_COLORS       16
+#define POOL_REPORT_FRAMES      100
+// Without -slice-rows, bands are cut into a slice per thread for the pool, no
+// thinner than this: a slice costs its header and its deflate setup
+#define POOL_MIN_SLICE_ROWS     8
+// Web apps that don't ack right away get the first frame this long after
+// connecting, see isRemoteReady()
+#define READY_TIMEOUT_MS        5000
+
+// A slice of the frame being encoded, see sendSlices()
+typedef struct uDoomSliceJob {
+    uDoomFrameHeader_t header;
+    const uint8_t *pImage;
+    uint8_t *pPayload;
+    size_t payloadSize;
+    uint32_t error;
+    uDoomPoolTask_t task;
+} uDoomSliceJob_t;
+
+static uDoomPipelineCfg_t gCfg;
+static uDoomPacketSend_t gpSend = NULL;
+static void *gpSendContext = NULL;
+// Counted by uDoomPipelineConnect(), the stream is started over on the game
+// thread, see restartStream()
+static uint32_t gConnections = 0;
+static uint32_t gConnectionsSeen = 0;
+static uint32_t gMtu = 0;
+static bool gIsRemoteReady = false;
+static uint64_t gConnectedUs = 0;
+static uDoomPacketizer_t gPacketizer;
+static uint32_t gFrameCount = 0;
+static uint16_t gSequence = 0;
+static uint64_t gStartTimeUs = 0;
+static uint32_t gRemoteFramesDropped = 0;
+static float gLinkCredit = 0.0F;
+static uint64_t gLinkCreditUs = 0;
+static uint32_t gFramesOverBudget = 0;
+// One palette above BUDGET_MIN_COLORS and one up to it, so going back and
+// forth between the two doesn't rebuild them
+static uDoomPalette_t gPalettes[2];
+static uDoomFec_t gFec;
+static uDoomSchedule_t gTxSchedule;
+// What the remote shows, as of the last frame sent
+static uint32_t gSentScreen[DOOMGENERIC_RESX * DOOMGENERIC_RESY];
+static bool gHasSentScreen = false;
+static uint32_t gFramesUnchanged = 0;
+// The image whose Adam7 passes are being sent, see sendPasses(), and the
+// screen rows it covers
+static uint8_t gProgressiveImage[DOOM_FRAME_SIZE];
+static uDoomFrameHeader_t gProgressiveBand;
+static uint32_t gProgressivePass = U_DOOM_IMAGE_ADAM7_PASSES;
+static uint32_t gProgressiveFirstRow = 0;
+static uint32_t gProgressiveEndRow = 0;
+static uint32_t gFramesCutShort = 0;
+static uDoomEncoder_t gEncoder;
+static uint32_t gBenchFrames = 0;
+static uint64_t gBenchPngBytes = 0;
+static uint64_t gBenchPngUs = 0;
+static uint64_t gBenchQoiBytes = 0;
+static uint64_t gBenchQoiUs = 0;
+static const uint32_t gBenchColors[2] = {U_DOOM_PALETTE_MAX_COLORS, BUDGET_MIN_COLORS};
+static uDoomPalette_t gBenchPalettes[2];
+static uint64_t gBenchLossyBytes[2] = {0};
+static float gBenchLossyPsnr[2] = {0.0F};
+static uDoomPool_t gPool;
+// One per worker, an encoder being used by a single thread at a time. The
+// game thread, the last worker of the pool, has gEncoder.
+static uDoomEncoder_t gWorkerEncoders[U_DOOM_POOL_MAX_WORKERS];
+static uDoomSliceJob_t gSliceJobs[DOOMGENERIC_RESY];
+static uint32_t gPoolFrames = 0;
+static uint32_t gSliceTasks = 0;
+static uint64_t gSliceTasksUs = 0;
+
+// Packets go out at most every txIntervalUs, the time spent sending one
+// counting towards the interval
+static void sendPacket(const uint8_t *pData, size_t size, void *pContext)
+{
+    (void)pContext;
+    if (gCfg.txIntervalUs > 0) {
+        uDoomScheduleWait(&gTxSchedule);
+    }
+    gpSend(pData, size, gpSendContext);
+}
+
+// Echo the last consumed latency-stamped key so the remote can compute the
+// key-to-photon round trip
+static void fillLatencyEcho(uDoomFrameHeader_t *pHeader)
+{
+    uDoomInputEvent_t event;
+
+    if (uDoomInputGetLastStamped(&event)) {
+        uint32_t dwellMs = event.consumedMs - event.receivedMs;
+        pHeader->flags |= U_DOOM_FRAME_FLAG_LATENCY_ECHO;
+        pHeader->echoId = event.id;
+        pHeader->echoDwellMs = (dwellMs > 0xFFFF) ? 0xFFFF : (uint16_t)dwellMs;
+        pHeader->echoSentMs = event.sentMs;
+    }
+}
+
+// Returns true if an ack arrived
+static bool handleAck(void)
+{
+    uDoomAck_t ack;
+    uDoomInputStats_t input;
+    bool isNew = uDoomInputGetAck(&ack);
+
+    if (isNew) {
+        printf("Remote: %u frames received, %u dropped, last sequence %u\n",
+               ack.framesReceived, ack.framesDropped, ack.lastSequence);
+        // Along with the acks, about once a second
+        uDoomInputGetStats(&input);
+        printf("Input: %u keys received, %u consumed, %u dropped, %u bytes ignored, "
+               "dwell %u ms, max %u ms\n", input.received, input.consumed, input.dropped,
+               input.ignoredBytes, input.lastDwellMs, input.maxDwellMs);
+        // The remote lost track of the frames it could refer to
+        if (ack.framesDropped != gRemoteFramesDropped) {
+            gRemoteFramesDropped = ack.framesDropped;
+            uDoomEncoderRequestKeyframe(&gEncoder);
+            gHasSentScreen = false;
+        }
+    }
+
+    return isNew;
+}
+
+// A new remote connected: it has no previous frame to refer to. Called by the
+// game thread, nothing is sent or encoded meanwhile.
+static void restartStream(void)
+{
+    if (gCfg.fecK > 0) {
+        // The packetizer leaves room for the FEC header
+        uDoomFecInit(&gFec, gCfg.fecK, gCfg.fecM, sendPacket, NULL);
+        uDoomPacketizerInit(&gPacketizer, (size_t)gMtu, U_DOOM_FEC_HEADER_SIZE, uDoomFecSend, &gFec);
+    } else {
+        uDoomPacketizerInit(&gPacketizer, (size_t)gMtu, 0, sendPacket, NULL);
+    }
+    uDoomEncoderRequestKeyframe(&gEncoder);
+    gHasSentScreen = false;
+    gConnectedUs = uDoomClockGetUs();
+    gIsRemoteReady = false;
+}
+
+// The remote is ready for frames once it acks, which the Web app does as soon
+// as it listens to the notifications. Web apps that only ack the frames they
+// got are sent the first one READY_TIMEOUT_MS after connecting instead.
+static bool isRemoteReady(void)
+{
+    if (!gIsRemoteReady && (handleAck() || (uDoomClockGetMsSince(gConnectedUs) >= READY_TIMEOUT_MS))) {
+        printf("Startup: remote ready %u ms after connecting, %u ms after start\n",
+               uDoomClockGetMsSince(gConnectedUs), uDoomClockGetMsSince(gCfg.startUs));
+        gStartTimeUs = uDoomClockGetUs();
+        gIsRemoteReady = true;
+    }
+
+    return gIsRemoteReady;
+}
+
+// The link budget is a credit growing by linkBudget bytes per second, up to
+// one second worth, which every frame sent spends
+static void refillLinkCredit(void)
+{
+    uint64_t nowUs = uDoomClockGetUs();
+
+    gLinkCredit += (float)gCfg.linkBudget * (float)(nowUs - gLinkCreditUs) / 1000000.0F;
+    if (gLinkCredit > (float)gCfg.linkBudget) {
+        gLinkCredit = (float)gCfg.linkBudget;
+    }
+    gLinkCreditUs = nowUs;
+}
+
+// The rows of the screen that differ from what the remote shows, all of them
+// if it shows nothing reliable. Returns false if nothing changed.
+static bool findDirtyRows(uint32_t *pFirstRow, uint32_t *pEndRow)
+{
+    if (!gHasSentScreen) {
+        *pFirstRow = 0;
+        *pEndRow = DOOMGENERIC_RESY;
+        return true;
+    }
+
+    return uDoomImageFindDirtyRows(DG_ScreenBuffer, gSentScreen, DOOMGENERIC_RESX, DOOMGENERIC_RESY,
+                                   pFirstRow, pEndRow);
+}
+
+// Converts the screen rows [firstRow, endRow) at the configured scale and
+// number of colors. If the band is estimated not to fit the link credit it
+// tries again with fewer colors, down to BUDGET_MIN_COLORS, which keeps the
+// detail, then at smaller scales. Fills in the geometry of the header. Returns
+// U_DOOM_SCALE_MAX_NUM if even the smallest doesn't fit: better drop the frame
+// than encode it.
+static uDoomScale_t convertWithinBudget(uint8_t *pImageBuffer, uint32_t firstRow, uint32_t endRow,
+                                        uDoomFrameHeader_t *pHeader)
+{
+    uDoomScale_t scale = gCfg.scale;
+    uint32_t colors = gCfg.paletteColors;
+    uint32_t width;
+    uint32_t frameHeight;
+    uint32_t y;
+    uint32_t height;
+    size_t estimate;
+
+    if (gCfg.linkBudget > 0) {
+        refillLinkCredit();
+    }
+
+    while (scale != U_DOOM_SCALE_MAX_NUM) {
+        uDoomImageGetScaledSize(scale, DOOMGENERIC_RESX, DOOMGENERIC_RESY, &width, &frameHeight);
+        uDoomImageConvertRows(pImageBuffer, DG_ScreenBuffer, DOOMGENERIC_RESX, DOOMGENERIC_RESY, scale,
+                              firstRow, endRow, &y, &height);
+        if (colors > 0) {
+            uDoomPaletteReduce(&gPalettes[(colors > BUDGET_MIN_COLORS) ? 0 : 1], pImageBuffer,
+                               width, height, y, colors);
+        }
+        if ((gCfg.linkBudget == 0) ||
+            (uDoomEncoderEstimate(&gEncoder, &estimate, pImageBuffer, width, height) != 0) ||
+            ((float)estimate <= gLinkCredit)) {
+            pHeader->width = (uint16_t)width;
+            pHeader->height = (uint16_t)height;
+            pHeader->yOffset = (uint16_t)y;
+            pHeader->frameHeight = (uint16_t)frameHeight;
+            break;
+        }
+        if ((colors == 0) || (colors > BUDGET_MIN_COLORS)) {
+            colors = (colors == 0) ? U_DOOM_PALETTE_MAX_COLORS : BUDGET_MIN_COLORS;
+        } else {
+            scale = uDoomImageGetSmallerScale(scale);
+        }
+    }
+
+    return scale;
+}
+
+// Queues one frame for sending, header, payload and trailer
+static void sendFrame(uDoomFrameHeader_t *pHeader, const uint8_t *pPayload, size_t payloadSize)
+{
+    uint8_t header[U_DOOM_FRAME_HEADER_MAX_SIZE];
+    uint8_t trailer[U_DOOM_FRAME_TRAILER_SIZE];
+
+    // Remote will expect payloadSize bytes after the header
+    pHeader->payloadSize = (uint32_t)payloadSize;
+    pHeader->flags = uDoomEncoderGetFrameFlags(&gEncoder);
+    if (pHeader->pass > 0) {
+        pHeader->flags |= U_DOOM_FRAME_FLAG_ADAM7_PASS;
+    }
+    pHeader->sequence = gSequence++;
+
+    fillLatencyEcho(pHeader);
+
+    // Only full packets go out, the tail of this frame is sent together
+    // with the header of the next one if it follows soon, see flushTail()
+    uDoomPacketizerWrite(&gPacketizer, header, uDoomFrameWriteHeader(header, pHeader));
+    uDoomPacketizerWrite(&gPacketizer, pPayload, payloadSize);
+    uDoomPacketizerWrite(&gPacketizer, trailer, uDoomFrameWriteTrailer(trailer, pPayload, payloadSize));
+    gLinkCredit -= (float)payloadSize;
+}
+
+static uDoomEncoder_t *getWorkerEncoder(uint32_t worker)
+{
+    return (worker < uDoomPoolGetWorkers(&gPool)) ? &gWorkerEncoders[worker] : &gEncoder;
+}
+
+// Runs on whichever worker of the pool takes the job
+static void encodeSliceTask(void *pContext, uint32_t worker)
+{
+    uDoomSliceJob_t *pJob = (uDoomSliceJob_t *)pContext;
+
+    pJob->error = uDoomEncoderEncode(getWorkerEncoder(worker), &pJob->pPayload, &pJob->payloadSize,
+                                     pJob->pImage, pJob->header.width, pJob->header.height);
+}
+
+// Encodes the band converted into pImageBuffer and sends it, cut into slices
+// of sliceRows screen rows if set. Each slice is a frame of its own, which
+// the remote paints as soon as it arrives: it starts going out while the next
+// one is encoded, and a lost packet only costs the slices it carried. With
+// workers, the slices are all queued at once and sent in order as they are
+// done, except in video deflate mode where each slice refers to the one
+// before, and without sliceRows the band is cut into a slice per thread.
+// Returns false if the band couldn't be sent whole.
+static bool sendSlices(const uint8_t *pImageBuffer, const uDoomFrameHeader_t *pBand)
+{
+    size_t rowBytes = (size_t)pBand->width * 4;
+    uint32_t sliceHeight = pBand->height;
+    uint32_t numSlices = 0;
+    bool isParallel = (uDoomPoolGetWorkers(&gPool) > 0) && (gCfg.codec != U_DOOM_CODEC_VIDEO_DEFLATE);
+    uint32_t error = 0;
+
+    if (gCfg.sliceRows > 0) {
+        // In rows of the scaled frame
+        sliceHeight = gCfg.sliceRows * pBand->frameHeight / DOOMGENERIC_RESY;
+        if (sliceHeight == 0) {
+            sliceHeight = 1;
+        }
+    } else if (isParallel) {
+        // The workers and the game thread waiting for them
+        uint32_t threads = uDoomPoolGetWorkers(&gPool) + 1;
+        sliceHeight = (pBand->height + threads - 1) / threads;
+        if (sliceHeight < POOL_MIN_SLICE_ROWS) {
+            sliceHeight = POOL_MIN_SLICE_ROWS;
+        }
+    }
+
+    for (uint32_t y = 0; y < pBand->height; y += sliceHeight) {
+        uDoomSliceJob_t *pJob = &gSliceJobs[numSlices++];
+        pJob->header = *pBand;
+        pJob->header.yOffset = (uint16_t)(pBand->yOffset + y);
+        pJob->header.height = (uint16_t)((pBand->height - y < sliceHeight) ? pBand->height - y : sliceHeight);
+        pJob->pImage = &pImageBuffer[y * rowBytes];
+        pJob->task.pFunction = encodeSliceTask;
+        pJob->task.pContext = pJob;
+        if (isParallel) {
+            uDoomPoolSubmit(&gPool, &pJob->task);
+        }
+    }
+
+    // All jobs are waited for, even after an error, they are reused next frame
+    for (uint32_t i = 0; i < numSlices; ++i) {
+        uDoomSliceJob_t *pJob = &gSliceJobs[i];
+        if (isParallel) {
+            uDoomPoolWait(&gPool, &pJob->task);
+            gSliceTasksUs += pJob->task.runUs;
+            ++gSliceTasks;
+            // A slice the game thread ran itself, stolen while waiting or
+            // run inline with the deque full, was learnt by gEncoder already
+            if (!pJob->error && (pJob->task.worker < uDoomPoolGetWorkers(&gPool))) {
+                uDoomEncoderLearn(&gEncoder, pJob->payloadSize, pJob->header.height);
+            }
+        } else if (!error) {
+            pJob->error = uDoomEncoderEncode(&gEncoder, &pJob->pPayload, &pJob->payloadSize, pJob->pImage,
+                                             pJob->header.width, pJob->header.height);
+        }
+        if (pJob->error && !error) {
+            error = pJob->error;
+            printf("lodepng error %u: %s\n", error, lodepng_error_text(error));
+        }
+        if (!error) {
+            sendFrame(&pJob->header, pJob->pPayload, pJob->payloadSize);
+        }
+    }
+
+    return !error;
+}
+
+// Over the encoders of the game thread and the workers
+static uint32_t getHuffmanReuse(void)
+{
+    uint64_t reused = 0;
+    uint64_t blocks = 0;
+
+    for (uint32_t i = 0; i <= uDoomPoolGetWorkers(&gPool); ++i) {
+        const LodePNGHuffmanCache *pCache = &getWorkerEncoder(i)->huffmanCache;
+        reused += pCache->reused;
+        blocks += pCache->reused + pCache->rebuilt;
+    }
+
+    return (blocks > 0) ? (uint32_t)(reused * 100 / blocks) : 0;
+}
+
+// Prints how busy the workers and the game thread were with encode tasks
+static void reportPool(void)
+{
+    uint32_t workers = uDoomPoolGetWorkers(&gPool);
+    uDoomPoolStats_t stats;
+
+    printf("Pool over %u frames: %u slice tasks, %u us on average\n", gPoolFrames, gSliceTasks,
+           (gSliceTasks > 0) ? (uint32_t)(gSliceTasksUs / gSliceTasks) : 0);
+    for (uint32_t i = 0; i <= workers; ++i) {
+        uDoomPoolGetStats(&gPool, i, &stats);
+        if (i < workers) {
+            printf("Pool worker %u: %u%% busy, %u tasks, %u stolen\n", i, stats.busyPercent,
+                   stats.tasks, stats.stolen);
+        } else {
+            printf("Pool, game thread while waiting: %u%% busy, %u tasks\n", stats.busyPercent, stats.tasks);
+        }
+    }
+    uDoomPoolResetStats(&gPool);
+    gPoolFrames = 0;
+    gSliceTasks = 0;
+    gSliceTasksUs = 0;
+}
+
+// Encodes the whole screen both with lodepng_encode32(), as the port first
+// did, and as QOI, checking that the reference decoder gives the screen back,
+// and with lodepng_encode32() again after reducing it to fewer colors. Prints
+// the average sizes, times and PSNR every CODEC_BENCH_FRAMES frames.
+static void benchmarkCodecs(void)
+{
+    uint8_t *pImage = (uint8_t *)uDoomArenaMalloc(DOOM_FRAME_SIZE);
+    uint8_t *pDecoded = (uint8_t *)uDoomArenaMalloc(DOOM_FRAME_SIZE);
+    uint8_t *pQoi = (uint8_t *)uDoomArenaMalloc(U_DOOM_QOI_MAX_SIZE(DOOMGENERIC_RESX, DOOMGENERIC_RESY));
+    uint8_t *pPng = NULL;
+    size_t pngSize = 0;
+    size_t qoiSize;
+    uint64_t startUs;
+    uint32_t error;
+
+    if ((pImage == NULL) || (pDecoded == NULL) || (pQoi == NULL)) {
+        return;
+    }
+    uDoomImageConvert(pImage, DG_ScreenBuffer, DOOMGENERIC_RESX, DOOMGENERIC_RESY, U_DOOM_SCALE_FULL);
+
+    startUs = uDoomClockGetUs();
+    error = lodepng_encode32(&pPng, &pngSize, pImage, DOOMGENERIC_RESX, DOOMGENERIC_RESY);
+    gBenchPngUs += uDoomClockGetUs() - startUs;
+    if (error) {
+        printf("lodepng error %u: %s\n", error, lodepng_error_text(error));
+        return;
+    }
+
+    startUs = uDoomClockGetUs();
+    qoiSize = uDoomQoiEncode(pQoi, pImage, DOOMGENERIC_RESX, DOOMGENERIC_RESY);
+    gBenchQoiUs += uDoomClockGetUs() - startUs;
+
+    if (!uDoomQoiDecode(pDecoded, DOOMGENERIC_RESX, DOOMGENERIC_RESY, pQoi, qoiSize) ||
+        (memcmp(pDecoded, pImage, DOOM_FRAME_SIZE) != 0)) {
+        printf("* QOI round trip failed\n");
+    }
+
+    for (uint32_t i = 0; (i < 2) && !error; ++i) {
+        uint8_t *pLossy = NULL;
+        size_t lossySize = 0;
+        // Done with the QOI round trip, the buffer is free again
+        memcpy(pDecoded, pImage, DOOM_FRAME_SIZE);
+        uDoomPaletteReduce(&gBenchPalettes[i], pDecoded, DOOMGENERIC_RESX, DOOMGENERIC_RESY, 0, gBenchColors[i]);
+        error = lodepng_encode32(&pLossy, &lossySize, pDecoded, DOOMGENERIC_RESX, DOOMGENERIC_RESY);
+        gBenchLossyBytes[i] += lossySize;
+        gBenchLossyPsnr[i] += uDoomImageGetPsnr(pDecoded, pImage, DOOMGENERIC_RESX, DOOMGENERIC_RESY);
+    }
+
+    gBenchPngBytes += pngSize;
+    gBenchQoiBytes += qoiSize;
+    if (++gBenchFrames == CODEC_BENCH_FRAMES) {
+        printf("Codec bench over %u frames: PNG %u bytes in %u us, QOI %u bytes in %u us (%u MB/s)\n",
+               gBenchFrames, (uint32_t)(gBenchPngBytes / gBenchFrames), (uint32_t)(gBenchPngUs / gBenchFrames),
+               (uint32_t)(gBenchQoiBytes / gBenchFrames), (uint32_t)(gBenchQoiUs / gBenchFrames),
+               (gBenchQoiUs > 0) ? (uint32_t)((uint64_t)DOOM_FRAME_SIZE * gBenchFrames / gBenchQoiUs) : 0);
+        for (uint32_t i = 0; i < 2; ++i) {
+            printf("Codec bench, PNG with %u colors: %u bytes, PSNR %.1f dB\n", gBenchColors[i],
+                   (uint32_t)(gBenchLossyBytes[i] / gBenchFrames), gBenchLossyPsnr[i] / (float)gBenchFrames);
+            gBenchLossyBytes[i] = 0;
+            gBenchLossyPsnr[i] = 0.0F;
+        }
+        gBenchFrames = 0;
+        gBenchPngBytes = 0;
+        gBenchPngUs = 0;
+        gBenchQoiBytes = 0;
+        gBenchQoiUs = 0;
+    }
+}
+
+// Sends the pending partial packet and the parity of its FEC group
+static void flushPackets(void)
+{
+    uDoomPacketizerFlush(&gPacketizer);
+    if (gCfg.fecK > 0) {
+        uDoomFecFlush(&gFec);
+    }
+}
+
+// Sends the tail of the last frame, which holds the end of its payload and its
+// trailer: the remote can't check nor paint the frame without it. It only waits
+// for the next frame if that one is due before the tail's own packet could go
+// out anyway. The FEC group carries on, its parity goes with the next frames.
+static void flushTail(void)
+{
+    if (gCfg.txIntervalUs < 1000000 / U_DOOM_TIC_RATE_HZ) {
+        uDoomPacketizerFlush(&gPacketizer);
+    }
+}
+
+// Sends the Adam7 passes of gProgressiveImage not sent yet, each a frame of
+// its own that the remote paints as it arrives, coarse first. The next pass
+// always goes, the ones after it until deadlineUs, the rest being left for
+// the next calls. The passes sent are flushed out, or the remote would only
+// see them with the next ones. Returns false if a pass couldn't be encoded.
+static bool sendPasses(uint64_t deadlineUs)
+{
+    bool isFirst = true;
+    bool isSent = true;
+
+    while ((gProgressivePass < U_DOOM_IMAGE_ADAM7_PASSES) && (isFirst || (uDoomClockGetUs() < deadlineUs))) {
+        uDoomFrameHeader_t passHeader = gProgressiveBand;
+        uint32_t passWidth;
+        uint32_t passHeight;
+        uint8_t *pPass;
+        uint8_t *pPayload;
+        size_t payloadSize;
+        uint32_t error = 83;
+
+        uDoomImageGetAdam7PassSize(gProgressivePass, passHeader.width, passHeader.height,
+                                   &passWidth, &passHeight);
+        passHeader.pass = (uint8_t)(gProgressivePass + 1);
+        if ((passWidth == 0) || (passHeight == 0)) {
+            ++gProgressivePass;
+            continue;
+        }
+
+        pPass = (uint8_t *)uDoomArenaMalloc((size_t)passWidth * passHeight * 4);
+        if (pPass != NULL) {
+            uDoomImageGetAdam7Pass(pPass, gProgressiveImage, passHeader.width, passHeader.height,
+                                   gProgressivePass);
+            error = uDoomEncoderEncode(&gEncoder, &pPayload, &payloadSize, pPass, passWidth, passHeight);
+        }
+        if (error) {
+            printf("lodepng error %u: %s\n", error, lodepng_error_text(error));
+            gProgressivePass = U_DOOM_IMAGE_ADAM7_PASSES;
+            isSent = false;
+            break;
+        }
+        sendFrame(&passHeader, pPayload, payloadSize);
+        ++gProgressivePass;
+        isFirst = false;
+    }
+    flushPackets();
+
+    return isSent;
+}
+
+void uDoomPipelineGetDefaults(uDoomPipelineCfg_t *pCfg)
+{
+    memset(pCfg, 0, sizeof(*pCfg));
+    pCfg->scale = U_DOOM_SCALE_FULL;
+    pCfg->huffmanReusePercent = -1;
+    pCfg->codec = U_DOOM_CODEC_PNG;
+    pCfg->txIntervalUs = U_DOOM_PIPELINE_TX_INTERVAL_US;
+}
+
+bool uDoomPipelineParseArgs(uDoomPipelineCfg_t *pCfg, int argc, char **argv)
+{
+    for (int i = 1; i < argc; ++i) {
+        bool hasValue = (i + 1 < argc);
+        if (strcmp(argv[i], "-video-deflate") == 0) {
+            pCfg->codec = U_DOOM_CODEC_VIDEO_DEFLATE;
+        } else if (strcmp(argv[i], "-qoi") == 0) {
+            pCfg->codec = U_DOOM_CODEC_QOI;
+        } else if (strcmp(argv[i], "-progressive") == 0) {
+            pCfg->progressive = true;
+        } else if (strcmp(argv[i], "-codec-bench") == 0) {
+            pCfg->codecBench = true;
+        } else if (hasValue && (strcmp(argv[i], "-scale") == 0)) {
+            pCfg->scale = uDoomImageScaleFromName(argv[i + 1]);
+            if (pCfg->scale == U_DOOM_SCALE_MAX_NUM) {
+                printf("* Unknown scale \"%s\", expected 1, 2, 4 or anamorphic\n", argv[i + 1]);
+                return false;
+            }
+        } else if (hasValue && (strcmp(argv[i], "-huffman-reuse") == 0)) {
+            pCfg->huffmanReusePercent = atoi(argv[i + 1]);
+        } else if (hasValue && (strcmp(argv[i], "-palette") == 0)) {
+            pCfg->paletteColors = (uint32_t)atoi(argv[i + 1]);
+            if ((pCfg->paletteColors < 2) || (pCfg->paletteColors > U_DOOM_PALETTE_MAX_COLORS)) {
+                printf("* Expected -palette <colors>, 2 to %u\n", U_DOOM_PALETTE_MAX_COLORS);
+                return false;
+            }
+        } else if (hasValue && (strcmp(argv[i], "-link-budget") == 0)) {
+            pCfg->linkBudget = (uint32_t)atoi(argv[i + 1]);
+        } else if (hasValue && (strcmp(argv[i], "-slice-rows") == 0)) {
+            pCfg->sliceRows = (uint32_t)atoi(argv[i + 1]);
+        } else if (hasValue && (strcmp(argv[i], "-fec") == 0)) {
+            if (sscanf(argv[i + 1], "%u,%u", &pCfg->fecK, &pCfg->fecM) != 2) {
+                printf("* Expected -fec <data packets>,<parity packets>, e.g. 8,2\n");
+                return false;
+            }
+        } else if (hasValue && (strcmp(argv[i], "-tx-interval-us") == 0)) {
+            pCfg->txIntervalUs = (uint32_t)atoi(argv[i + 1]);
+        } else if (hasValue && (strcmp(argv[i], "-workers") == 0)) {
+            pCfg->workers = (uint32_t)atoi(argv[i + 1]);
+            if (pCfg->workers > U_DOOM_POOL_MAX_WORKERS) {
+                printf("* Expected -workers <count>, up to %u\n", U_DOOM_POOL_MAX_WORKERS);
+                return false;
+            }
+        }
+    }
+    if (pCfg->progressive && (pCfg->codec == U_DOOM_CODEC_VIDEO_DEFLATE)) {
+        // A pass dropped would leave the next frames without their reference
+        printf("* -progressive doesn't go with -video-deflate\n");
+        return false;
+    }
+    if ((pCfg->workers > 0) && (pCfg->progressive || (pCfg->codec == U_DOOM_CODEC_VIDEO_DEFLATE))) {
+        // Passes are encoded one at a time until the deadline of the tic, and
+        // each video deflate slice refers to the one before
+        printf("* -workers is ignored with -progressive and -video-deflate, the game thread encodes\n");
+        pCfg->workers = 0;
+    }
+
+    return true;
+}
+
+bool uDoomPipelineInit(const uDoomPipelineCfg_t *pCfg, uDoomPacketSend_t pSend, void *pContext)
+{
+    gCfg = *pCfg;
+    gpSend = pSend;
+    gpSendContext = pContext;
+    uDoomEncoderInit(&gEncoder, gCfg.huffmanReusePercent, gCfg.codec);
+    for (uint32_t i = 0; i < gCfg.workers; ++i) {
+        uDoomEncoderInit(&gWorkerEncoders[i], gCfg.huffmanReusePercent, gCfg.codec);
+    }
+    // Only the palettes used are written to, the others stay out of memory
+    for (uint32_t i = 0; i < 2; ++i) {
+        if ((gCfg.paletteColors > 0) || (gCfg.linkBudget > 0)) {
+            uDoomPaletteInit(&gPalettes[i]);
+        }
+        if (gCfg.codecBench) {
+            uDoomPaletteInit(&gBenchPalettes[i]);
+        }
+    }
+    uDoomScheduleInit(&gTxSchedule, gCfg.txIntervalUs, 1);
+
+    return uDoomPoolInit(&gPool, gCfg.workers);
+}
+
+void uDoomPipelineConnect(uint32_t mtu)
+{
+    // The game thread or a worker may be sending or encoding right now
+    gMtu = mtu;
+    U_DOOM_STORE_RELEASE(&gConnections, gConnections + 1);
+}
+
+void uDoomPipelineDrawFrame(void)
+{
+    uint32_t connections = U_DOOM_LOAD_ACQUIRE(&gConnections);
+
+    if (connections != gConnectionsSeen) {
+        gConnectionsSeen = connections;
+        restartStream();
+    }
+
+    if (isRemoteReady()) {
+        float fps;
+        uint8_t pImageBuffer[DOOM_FRAME_SIZE];
+        uDoomFrameHeader_t band = {0};
+        uint32_t firstRow;
+        uint32_t endRow;
+        bool isDirty;
+        bool isSent = false;
+        uint64_t deadlineUs = uDoomClockGetUs() + 1000000 / U_DOOM_TIC_RATE_HZ;
+
+        if (gCfg.codecBench) {
+            benchmarkCodecs();
+        }
+
+        // Only the band of rows that changed since the last frame sent is
+        // encoded, a static screen costs nothing but the comparison. Downscaling
+        // here cuts the encode time and the airtime, the remote scales the
+        // image back up to the screen size.
+        isDirty = findDirtyRows(&firstRow, &endRow);
+        if (isDirty && (gProgressivePass < U_DOOM_IMAGE_ADAM7_PASSES)) {
+            // A newer frame is ready: the passes left of the previous one are
+            // dropped, the new one also covers the rows they would have refined
+            firstRow = (gProgressiveFirstRow < firstRow) ? gProgressiveFirstRow : firstRow;
+            endRow = (gProgressiveEndRow > endRow) ? gProgressiveEndRow : endRow;
+            gProgressivePass = U_DOOM_IMAGE_ADAM7_PASSES;
+            gHasSentScreen = false;
+            ++gFramesCutShort;
+        }
+
+        if (!isDirty) {
+            ++gFramesUnchanged;
+        } else if (convertWithinBudget(pImageBuffer, firstRow, endRow, &band) != U_DOOM_SCALE_MAX_NUM) {
+            if (gCfg.progressive) {
+                memcpy(gProgressiveImage, pImageBuffer, (size_t)band.width * band.height * 4);
+                gProgressiveBand = band;
+                gProgressivePass = 0;
+                isSent = sendPasses(deadlineUs);
+            } else {
+                isSent = sendSlices(pImageBuffer, &band);
+                flushTail();
+            }
+            // Part of the band may have gone, the remote's screen is unknown
+            gHasSentScreen = isSent;
+        } else {
+            ++gFramesOverBudget;
+        }
+
+        if (isSent) {
+            // The band sent, widened to the blocks of its scale
+            firstRow = band.yOffset * DOOMGENERIC_RESY / band.frameHeight;
+            endRow = (band.yOffset + band.height) * DOOMGENERIC_RESY / band.frameHeight;
+            memcpy(&gSentScreen[firstRow * DOOMGENERIC_RESX], &DG_ScreenBuffer[firstRow * DOOMGENERIC_RESX],
+                   (endRow - firstRow) * DOOMGENERIC_RESX * sizeof(uint32_t));
+            gProgressiveFirstRow = firstRow;
+            gProgressiveEndRow = endRow;
+
+            ++gFrameCount;
+            fps = (float)gFrameCount / ((float)(uDoomClockGetUs() - gStartTimeUs) / 1000000.0F);
+            printf("FPS: %.2f, airtime efficiency: %u%%, Huffman reuse: %u%%, dropped over budget: %u, "
+                   "unchanged: %u, FEC overhead: %u%%, palette changes: %u, cut short: %u\n", fps,
+                   uDoomPacketizerGetEfficiency(&gPacketizer), getHuffmanReuse(),
+                   gFramesOverBudget, gFramesUnchanged, (gCfg.fecK > 0) ? uDoomFecGetOverhead(&gFec) : 0,
+                   uDoomPaletteGetChanges(&gPalettes[0]) + uDoomPaletteGetChanges(&gPalettes[1]),
+                   gFramesCutShort);
+            handleAck();
+            if ((uDoomPoolGetWorkers(&gPool) > 0) && (++gPoolFrames == POOL_REPORT_FRAMES)) {
+                reportPool();
+            }
+        } else if (gProgressivePass < U_DOOM_IMAGE_ADAM7_PASSES) {
+            // Nothing newer, on with the passes of the last frame
+            if (!sendPasses(deadlineUs)) {
+                gHasSentScreen = false;
+            }
+        } else {
+            // No frame to pack the pending tail with
+            flushPackets();
+        }
+
+        // Everything the encoder allocated, the PNGs included, goes at once,
+        // the workers give theirs back before their next task
+        if (uDoomArenaReset()) {
+            printf("Frame arena: %zu kB, high-water mark %zu kB\n",
+                   uDoomArenaGetCapacity() / 1024, uDoomArenaGetHighWaterMark() / 1024);
+        }
+        uDoomPoolNextFrame(&gPool);
+    }
+}
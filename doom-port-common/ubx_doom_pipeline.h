@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "ubx_doom_encoder.h"
+#include "ubx_doom_frame.h"
+#include "ubx_doom_image.h"
+
+// Everything between Doom's screen and the packets, the same for every port:
+// finding what changed since the last frame, converting it within the link
+// budget, encoding it whole, in slices on the worker pool or as Adam7 passes,
+// and packing the frames into packets with the optional FEC. The port only
+// brings up the link, hands over the packets and calls
+// uDoomPipelineDrawFrame() from DG_DrawFrame().
+
+// DG_DrawFrame() is called once per tic
+#define U_DOOM_TIC_RATE_HZ                  35
+#define U_DOOM_PIPELINE_TX_INTERVAL_US      3000
+
+typedef struct uDoomPipelineCfg {
+    uDoomScale_t scale;
+    // See uDoomEncoderInit()
+    int32_t huffmanReusePercent;
+    uDoomCodec_t codec;
+    // Bytes per second, 0 for none
+    uint32_t linkBudget;
+    // 0 for the full palette
+    uint32_t paletteColors;
+    // Screen rows per slice, 0 for whole bands
+    uint32_t sliceRows;
+    // Data and parity packets per FEC group, no FEC if fecK is 0
+    uint32_t fecK;
+    uint32_t fecM;
+    // Least time between two packets
+    uint32_t txIntervalUs;
+    bool progressive;
+    bool codecBench;
+    // Encode threads besides the game thread
+    uint32_t workers;
+    // When the process started, for the startup timings
+    uint64_t startUs;
+} uDoomPipelineCfg_t;
+
+void uDoomPipelineGetDefaults(uDoomPipelineCfg_t *pCfg);
+
+// Reads the options of the pipeline from the command line, leaving the others
+// to the port and to Doom. Returns false, after saying why, if one is wrong.
+bool uDoomPipelineParseArgs(uDoomPipelineCfg_t *pCfg, int argc, char **argv);
+
+// pSend sends a packet over the link, the pipeline paces them. Call it after
+// uPortInit(), the workers run on ubxlib. Returns false if they couldn't be
+// started.
+bool uDoomPipelineInit(const uDoomPipelineCfg_t *pCfg, uDoomPacketSend_t pSend, void *pContext);
+
+// A remote connected, with that MTU: the stream starts over with the next
+// frame. Called from the connection callback, on any thread.
+void uDoomPipelineConnect(uint32_t mtu);
+
+// Sends the screen, or what changed of it, once the remote is ready. Called
+// from DG_DrawFrame() while connected.
+void uDoomPipelineDrawFrame(void);
@@ -0,0 +1,254 @@
+#include <string.h>
+#include "ubx_doom_clock.h"
+#include "ubx_doom_pool.h"
+
+#define DEQUE_MASK      (U_DOOM_POOL_DEQUE_SIZE - 1)
+
+// Every task queued gives queued once, but a worker woken up drains all the
+// deques before taking it again: the count can run ahead of the tasks left,
+// the workers then wake up for nothing. The limit only bounds that.
+#define QUEUED_LIMIT    ((U_DOOM_POOL_MAX_WORKERS + 1) * U_DOOM_POOL_DEQUE_SIZE)
+
+// Without workers there are no locks, nor other threads
+static void lock(uDoomPool_t *pPool)
+{
+    if (pPool->numWorkers > 0) {
+        uPortMutexLock(pPool->mutex);
+    }
+}
+
+static void unlock(uDoomPool_t *pPool)
+{
+    if (pPool->numWorkers > 0) {
+        uPortMutexUnlock(pPool->mutex);
+    }
+}
+
+static uDoomPoolTask_t *popFront(uDoomPoolWorker_t *pWorker)
+{
+    uDoomPoolTask_t *pTask = NULL;
+
+    uPortMutexLock(pWorker->dequeMutex);
+    if (pWorker->back != pWorker->front) {
+        pTask = pWorker->pDeque[pWorker->front++ & DEQUE_MASK];
+    }
+    uPortMutexUnlock(pWorker->dequeMutex);
+
+    return pTask;
+}
+
+static uDoomPoolTask_t *popBack(uDoomPoolWorker_t *pWorker)
+{
+    uDoomPoolTask_t *pTask = NULL;
+
+    uPortMutexLock(pWorker->dequeMutex);
+    if (pWorker->back != pWorker->front) {
+        pTask = pWorker->pDeque[--pWorker->back & DEQUE_MASK];
+    }
+    uPortMutexUnlock(pWorker->dequeMutex);
+
+    return pTask;
+}
+
+// A worker takes from its own deque first, then steals from the others, the
+// newest task; the waiting thread has none and takes the oldest, which it is
+// likely waiting for
+static uDoomPoolTask_t *takeTask(uDoomPool_t *pPool, uint32_t worker, bool *pIsStolen)
+{
+    bool isWaiting = (worker == pPool->numWorkers);
+    uDoomPoolTask_t *pTask = NULL;
+
+    *pIsStolen = false;
+    if (!isWaiting) {
+        pTask = popFront(&pPool->workers[worker]);
+    }
+    for (uint32_t i = 1; (i <= pPool->numWorkers) && (pTask == NULL); ++i) {
+        uDoomPoolWorker_t *pVictim = &pPool->workers[(worker + i) % (pPool->numWorkers + 1)];
+        if (pVictim->index != pPool->numWorkers) {
+            pTask = isWaiting ? popFront(pVictim) : popBack(pVictim);
+            *pIsStolen = !isWaiting && (pTask != NULL);
+        }
+    }
+
+    return pTask;
+}
+
+static void runTask(uDoomPool_t *pPool, uDoomPoolTask_t *pTask, uint32_t worker, bool isStolen)
+{
+    uDoomPoolWorker_t *pWorker = &pPool->workers[worker];
+    uint64_t startUs = uDoomClockGetUs();
+    bool isWaitedFor;
+
+    pTask->pFunction(pTask->pContext, worker);
+
+    lock(pPool);
+    pTask->worker = worker;
+    pTask->runUs = uDoomClockGetUs() - startUs;
+    pTask->isDone = true;
+    pWorker->busyUs += pTask->runUs;
+    ++pWorker->tasks;
+    if (isStolen) {
+        ++pWorker->stolen;
+    }
+    isWaitedFor = (pPool->pWaitedTask == pTask);
+    if (isWaitedFor) {
+        pPool->pWaitedTask = NULL;
+    }
+    unlock(pPool);
+    if (isWaitedFor) {
+        uPortSemaphoreGive(pPool->done);
+    }
+}
+
+// Runs a queued task, if there is one
+static bool runNext(uDoomPool_t *pPool, uint32_t worker)
+{
+    uDoomPoolWorker_t *pWorker = &pPool->workers[worker];
+    uDoomPoolTask_t *pTask;
+    bool isStolen;
+    uint32_t frame;
+
+    pTask = takeTask(pPool, worker, &isStolen);
+    if (pTask == NULL) {
+        return false;
+    }
+
+    if (worker != pPool->numWorkers) {
+        // The first task of a frame, what the last frame allocated is done with
+        lock(pPool);
+        frame = pPool->frame;
+        unlock(pPool);
+        if (frame != pWorker->arenaFrame) {
+            uDoomArenaReset();
+            pWorker->arenaFrame = frame;
+        }
+    }
+    runTask(pPool, pTask, worker, isStolen);
+
+    return true;
+}
+
+static void workerTask(void *pParameter)
+{
+    uDoomPoolWorker_t *pWorker = (uDoomPoolWorker_t *)pParameter;
+    uDoomPool_t *pPool = pWorker->pPool;
+
+    uDoomArenaSelect(&pWorker->arena);
+    for (;;) {
+        uPortSemaphoreTake(pPool->queued);
+        while (runNext(pPool, pWorker->index)) {
+        }
+    }
+}
+
+bool uDoomPoolInit(uDoomPool_t *pPool, uint32_t numWorkers)
+{
+    bool isOk = true;
+
+    memset(pPool, 0, sizeof(*pPool));
+    pPool->numWorkers = (numWorkers > U_DOOM_POOL_MAX_WORKERS) ? U_DOOM_POOL_MAX_WORKERS : numWorkers;
+    pPool->statsStartUs = uDoomClockGetUs();
+    for (uint32_t i = 0; i <= pPool->numWorkers; ++i) {
+        pPool->workers[i].pPool = pPool;
+        pPool->workers[i].index = i;
+        uDoomArenaInit(&pPool->workers[i].arena);
+    }
+    if (pPool->numWorkers == 0) {
+        return true;
+    }
+
+    isOk = (uPortMutexCreate(&pPool->mutex) == 0) &&
+           (uPortSemaphoreCreate(&pPool->queued, 0, QUEUED_LIMIT) == 0) &&
+           (uPortSemaphoreCreate(&pPool->done, 0, 1) == 0);
+    for (uint32_t i = 0; (i < pPool->numWorkers) && isOk; ++i) {
+        uPortTaskHandle_t task;
+        isOk = (uPortMutexCreate(&pPool->workers[i].dequeMutex) == 0) &&
+               (uPortTaskCreate(workerTask, "doomWorker", U_DOOM_POOL_STACK_SIZE, &pPool->workers[i],
+                                U_CFG_OS_APP_TASK_PRIORITY, &task) == 0);
+    }
+
+    return isOk;
+}
+
+uint32_t uDoomPoolGetWorkers(const uDoomPool_t *pPool)
+{
+    return pPool->numWorkers;
+}
+
+void uDoomPoolSubmit(uDoomPool_t *pPool, uDoomPoolTask_t *pTask)
+{
+    bool isQueued = false;
+
+    pTask->isDone = false;
+    if (pPool->numWorkers > 0) {
+        uDoomPoolWorker_t *pWorker = &pPool->workers[pPool->nextDeque];
+        pPool->nextDeque = (pPool->nextDeque + 1) % pPool->numWorkers;
+        uPortMutexLock(pWorker->dequeMutex);
+        if (pWorker->back - pWorker->front < U_DOOM_POOL_DEQUE_SIZE) {
+            pWorker->pDeque[pWorker->back++ & DEQUE_MASK] = pTask;
+            isQueued = true;
+        }
+        uPortMutexUnlock(pWorker->dequeMutex);
+    }
+
+    if (isQueued) {
+        uPortSemaphoreGive(pPool->queued);
+    } else {
+        runTask(pPool, pTask, pPool->numWorkers, false);
+    }
+}
+
+void uDoomPoolWait(uDoomPool_t *pPool, uDoomPoolTask_t *pTask)
+{
+    bool isDone = (pPool->numWorkers == 0);
+
+    while (!isDone) {
+        lock(pPool);
+        isDone = pTask->isDone;
+        unlock(pPool);
+        if (!isDone && !runNext(pPool, pPool->numWorkers)) {
+            // All running: the worker running the task gives done once it is
+            // through, if it wasn't already
+            lock(pPool);
+            isDone = pTask->isDone;
+            if (!isDone) {
+                pPool->pWaitedTask = pTask;
+            }
+            unlock(pPool);
+            if (!isDone) {
+                uPortSemaphoreTake(pPool->done);
+            }
+        }
+    }
+}
+
+void uDoomPoolNextFrame(uDoomPool_t *pPool)
+{
+    lock(pPool);
+    ++pPool->frame;
+    unlock(pPool);
+}
+
+void uDoomPoolGetStats(uDoomPool_t *pPool, uint32_t worker, uDoomPoolStats_t *pStats)
+{
+    uDoomPoolWorker_t *pWorker = &pPool->workers[worker];
+    uint64_t elapsedUs = uDoomClockGetUs() - pPool->statsStartUs;
+
+    lock(pPool);
+    pStats->busyPercent = (elapsedUs > 0) ? (uint32_t)(pWorker->busyUs * 100 / elapsedUs) : 0;
+    pStats->tasks = pWorker->tasks;
+    pStats->stolen = pWorker->stolen;
+    unlock(pPool);
+}
+
+void uDoomPoolResetStats(uDoomPool_t *pPool)
+{
+    lock(pPool);
+    for (uint32_t i = 0; i <= pPool->numWorkers; ++i) {
+        pPool->workers[i].busyUs = 0;
+        pPool->workers[i].tasks = 0;
+        pPool->workers[i].stolen = 0;
+    }
+    pPool->statsStartUs = uDoomClockGetUs();
+    unlock(pPool);
+}
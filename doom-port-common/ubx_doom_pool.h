@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "ubxlib.h"
+#include "ubx_doom_arena.h"
+
+// Fixed pool of worker threads for the encode jobs of a frame, such as its
+// slices. Every worker has a deque of tasks and an arena of its own, so they
+// don't contend on either. Tasks are queued round robin over the deques. A
+// worker runs the oldest task of its own deque and, once that is empty,
+// steals the newest one of another, which is the one needed last. The thread
+// waiting for a task runs queued tasks meanwhile rather than sleeping, the
+// oldest first, so the pool never has more threads busy than workers plus one.
+//
+// Tasks are given the index of the worker running them, for state kept per
+// worker, such as an encoder. The waiting thread counts as worker
+// uDoomPoolGetWorkers() and allocates from its own arena as usual. What the
+// workers allocate stays valid until uDoomPoolNextFrame().
+#define U_DOOM_POOL_MAX_WORKERS     16
+// Tasks queued per worker, more are run by the thread submitting them
+#define U_DOOM_POOL_DEQUE_SIZE      64
+#define U_DOOM_POOL_STACK_SIZE      (256 * 1024)
+
+typedef struct uDoomPoolTask {
+    void (*pFunction)(void *pContext, uint32_t worker);
+    void *pContext;
+    // Filled in by the pool
+    bool isDone;
+    uint32_t worker;
+    uint64_t runUs;
+} uDoomPoolTask_t;
+
+typedef struct uDoomPoolWorker {
+    struct uDoomPool *pPool;
+    uint32_t index;
+    // Tasks front to back, oldest first
+    uPortMutexHandle_t dequeMutex;
+    uDoomPoolTask_t *pDeque[U_DOOM_POOL_DEQUE_SIZE];
+    uint32_t front;
+    uint32_t back;
+    uDoomArena_t arena;
+    // Frame the allocations in the arena are from
+    uint32_t arenaFrame;
+    // Since uDoomPoolResetStats()
+    uint64_t busyUs;
+    uint32_t tasks;
+    uint32_t stolen;
+} uDoomPoolWorker_t;
+
+typedef struct uDoomPool {
+    uint32_t numWorkers;
+    // The last one is the waiting thread
+    uDoomPoolWorker_t workers[U_DOOM_POOL_MAX_WORKERS + 1];
+    // Given for every task queued, and when the task the waiting thread
+    // sleeps on is done
+    uPortSemaphoreHandle_t queued;
+    uPortSemaphoreHandle_t done;
+    uDoomPoolTask_t *pWaitedTask;
+    // For isDone, pWaitedTask, the statistics and the frame
+    uPortMutexHandle_t mutex;
+    uint32_t nextDeque;
+    uint32_t frame;
+    uint64_t statsStartUs;
+} uDoomPool_t;
+
+typedef struct uDoomPoolStats {
+    // Share of the time spent running tasks
+    uint32_t busyPercent;
+    uint32_t tasks;
+    // Taken from the deque of another worker
+    uint32_t stolen;
+} uDoomPoolStats_t;
+
+// Starts numWorkers threads, up to U_DOOM_POOL_MAX_WORKERS, after uPortInit().
+// With none, tasks run on the thread submitting them. Returns false if a
+// thread or its locks couldn't be created.
+bool uDoomPoolInit(uDoomPool_t *pPool, uint32_t numWorkers);
+
+uint32_t uDoomPoolGetWorkers(const uDoomPool_t *pPool);
+
+// Queues the task, which must stay in place until uDoomPoolWait() returns
+void uDoomPoolSubmit(uDoomPool_t *pPool, uDoomPoolTask_t *pTask);
+
+// Returns once the task has run, running queued tasks meanwhile
+void uDoomPoolWait(uDoomPool_t *pPool, uDoomPoolTask_t *pTask);
+
+// The workers give back what they allocated, before their next task. Call it
+// at the end of every frame, once its tasks are done.
+void uDoomPoolNextFrame(uDoomPool_t *pPool);
+
+// Worker uDoomPoolGetWorkers() being the waiting thread
+void uDoomPoolGetStats(uDoomPool_t *pPool, uint32_t worker, uDoomPoolStats_t *pStats);
+
+void uDoomPoolResetStats(uDoomPool_t *pPool);
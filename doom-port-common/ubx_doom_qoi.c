@@ -0,0 +1,155 @@
+#include <string.h>
+#include "ubx_doom_qoi.h"
+
+#define OP_INDEX    0x00
+#define OP_DIFF     0x40
+#define OP_LUMA     0x80
+#define OP_RUN      0xC0
+#define OP_RGB      0xFE
+#define OP_MASK     0xC0
+
+#define MAX_RUN     62
+
+#define HASH(r, g, b) (((r) * 3 + (g) * 5 + (b) * 7 + 255 * 11) % U_DOOM_QOI_CACHE_SIZE)
+
+// The pixel as a word with the alpha byte set, whatever the byte order, so
+// pixels compare in one go and the empty cache entries never match
+static inline uint32_t loadPixel(const uint8_t *pPixel, uint32_t alpha)
+{
+    uint32_t word;
+
+    memcpy(&word, pPixel, sizeof(word));
+
+    return word | alpha;
+}
+
+size_t uDoomQoiEncode(uint8_t *pOut, const uint8_t *pImage, uint32_t width, uint32_t height)
+{
+    static const uint8_t opaque[4] = {0, 0, 0, 0xFF};
+    uint32_t cache[U_DOOM_QOI_CACHE_SIZE] = {0};
+    const uint8_t *pPixel = pImage;
+    const uint8_t *pEnd = pImage + (size_t)width * height * 4;
+    uint8_t *p = pOut;
+    uint32_t alpha;
+    uint32_t previous;
+    int32_t r = 0;
+    int32_t g = 0;
+    int32_t b = 0;
+
+    memcpy(&alpha, opaque, sizeof(alpha));
+    previous = alpha;
+
+    while (pPixel < pEnd) {
+        uint32_t word = loadPixel(pPixel, alpha);
+
+        if (word == previous) {
+            // Most of a Doom frame is runs, find the end of this one in a
+            // tight loop before emitting anything
+            const uint8_t *pRun = pPixel + 4;
+            size_t run;
+
+            while ((pRun < pEnd) && (loadPixel(pRun, alpha) == previous)) {
+                pRun += 4;
+            }
+            run = (size_t)(pRun - pPixel) / 4;
+            for (; run >= MAX_RUN; run -= MAX_RUN) {
+                *p++ = OP_RUN | (MAX_RUN - 1);
+            }
+            if (run > 0) {
+                *p++ = (uint8_t)(OP_RUN | (run - 1));
+            }
+            pPixel = pRun;
+        } else {
+            int32_t dr = (int8_t)(pPixel[0] - r);
+            int32_t dg = (int8_t)(pPixel[1] - g);
+            int32_t db = (int8_t)(pPixel[2] - b);
+            uint32_t index;
+
+            r = pPixel[0];
+            g = pPixel[1];
+            b = pPixel[2];
+            index = HASH(r, g, b);
+
+            if (cache[index] == word) {
+                *p++ = (uint8_t)(OP_INDEX | index);
+            } else {
+                cache[index] = word;
+                if ((dr >= -2) && (dr <= 1) && (dg >= -2) && (dg <= 1) && (db >= -2) && (db <= 1)) {
+                    *p++ = (uint8_t)(OP_DIFF | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));
+                } else if ((dg >= -32) && (dg <= 31) && (dr - dg >= -8) && (dr - dg <= 7) &&
+                           (db - dg >= -8) && (db - dg <= 7)) {
+                    *p++ = (uint8_t)(OP_LUMA | (dg + 32));
+                    *p++ = (uint8_t)(((dr - dg + 8) << 4) | (db - dg + 8));
+                } else {
+                    *p++ = OP_RGB;
+                    *p++ = (uint8_t)r;
+                    *p++ = (uint8_t)g;
+                    *p++ = (uint8_t)b;
+                }
+            }
+            previous = word;
+            pPixel += 4;
+        }
+    }
+
+    return (size_t)(p - pOut);
+}
+
+bool uDoomQoiDecode(uint8_t *pImage, uint32_t width, uint32_t height,
+                    const uint8_t *pData, size_t size)
+{
+    uint8_t cache[U_DOOM_QOI_CACHE_SIZE][3] = {{0}};
+    uint8_t *pOut = pImage;
+    uint8_t *pEnd = pImage + (size_t)width * height * 4;
+    const uint8_t *pDataEnd = pData + size;
+    uint8_t pixel[3] = {0, 0, 0};
+
+    while ((pOut < pEnd) && (pData < pDataEnd)) {
+        uint8_t op = *pData++;
+        size_t count = 1;
+
+        if (op == OP_RGB) {
+            if (pDataEnd - pData < 3) {
+                return false;
+            }
+            memcpy(pixel, pData, 3);
+            pData += 3;
+        } else if ((op & OP_MASK) == OP_INDEX) {
+            memcpy(pixel, cache[op], 3);
+        } else if ((op & OP_MASK) == OP_DIFF) {
+            pixel[0] += ((op >> 4) & 0x03) - 2;
+            pixel[1] += ((op >> 2) & 0x03) - 2;
+            pixel[2] += (op & 0x03) - 2;
+        } else if ((op & OP_MASK) == OP_LUMA) {
+            int32_t dg = (op & 0x3F) - 32;
+            if (pData == pDataEnd) {
+                return false;
+            }
+            pixel[0] += dg + (*pData >> 4) - 8;
+            pixel[1] += dg;
+            pixel[2] += dg + (*pData & 0x0F) - 8;
+            ++pData;
+        } else if (op != 0xFF) {
+            count = (size_t)(op & 0x3F) + 1;
+            if (count > (size_t)(pEnd - pOut) / 4) {
+                return false;
+            }
+        } else {
+            // Reserved
+            return false;
+        }
+
+        // Runs leave the cache alone
+        if ((op == OP_RGB) || ((op & OP_MASK) != OP_RUN)) {
+            memcpy(cache[HASH(pixel[0], pixel[1], pixel[2])], pixel, 3);
+        }
+        for (; count > 0; --count) {
+            *pOut++ = pixel[0];
+            *pOut++ = pixel[1];
+            *pOut++ = pixel[2];
+            *pOut++ = 0xFF;
+        }
+    }
+
+    return (pOut == pEnd) && (pData == pDataEnd);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Single pass, byte oriented lossless codec after QOI ("Quite OK Image"),
+// for links and hosts where deflate costs more time than it saves airtime.
+// Doom draws from a 256 color palette, so most pixels either repeat the one
+// before or are one of the few colors seen lately, which the index cache
+// catches. The other ops cover small color steps, as in gradients.
+//
+// The payload is a sequence of ops over the RGB pixels of the image, row by
+// row, with no header: width and height are those of the frame header.
+// Decoding starts from black as the previous pixel and an empty cache of
+// U_DOOM_QOI_CACHE_SIZE colors. Every pixel decoded by an op other than RUN
+// is stored in the cache at (R * 3 + G * 5 + B * 7 + 255 * 11) % 64.
+// [00 INDEX (6 bit)]                          pixel from the cache
+// [01 DR (2 bit) DG (2 bit) DB (2 bit)]       previous pixel + D - 2
+// [10 DG (6 bit)][DR - DG (4 bit) DB - DG (4 bit)]
+//                                             previous pixel + DG - 32 for
+//                                             green, + DG - 32 + D* - 8 for
+//                                             red and blue
+// [11 RUN (6 bit)]                            previous pixel RUN + 1 times,
+//                                             RUN up to 61
+// [0xFE][R][G][B]                             pixel as is
+// All differences wrap around modulo 256. These are QOI's ops without the
+// alpha channel; frames don't depend on each other, so a lost slice costs
+// nothing but itself.
+#define U_DOOM_QOI_CACHE_SIZE   64
+
+// Largest payload uDoomQoiEncode() can give for the image, one RGB op per pixel
+#define U_DOOM_QOI_MAX_SIZE(width, height) ((size_t)(width) * (height) * 4)
+
+// Encodes an opaque RGBA image, whose alpha is ignored, into pOut, which
+// must hold U_DOOM_QOI_MAX_SIZE() bytes. Returns the payload size.
+size_t uDoomQoiEncode(uint8_t *pOut, const uint8_t *pImage, uint32_t width, uint32_t height);
+
+// Reference decoder, into an opaque RGBA image of width * height * 4 bytes.
+// Returns false if the payload doesn't decode into exactly that many pixels.
+bool uDoomQoiDecode(uint8_t *pImage, uint32_t width, uint32_t height,
+                    const uint8_t *pData, size_t size);
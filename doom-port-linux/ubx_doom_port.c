@@ -1,42 +1,26 @@
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
-#include <sys/time.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
 #include "ubxlib.h"
 #include "doomkeys.h"
 #include "doomgeneric.h"
 #include "lodepng.h"
+#include "ubx_doom_clock.h"
+#include "ubx_doom_input.h"
+#include "ubx_doom_pipeline.h"
 
 // X * Y * 4 (RGBA size)
 #define DOOM_FRAME_SIZE         (DOOMGENERIC_RESX * DOOMGENERIC_RESY * 4)
 #define SINGLE_PACKET_SIZE      244
 #define TX_SLEEP_MS             1
-#define TX_SLEEP_US             3000
-#define KEY_QUEUE_SIZE          100
-
-enum { 
-    UP_KEY = 38,
-    DOWN_KEY = 40,
-    LEFT_KEY = 37,
-    RIGHT_KEY = 39,
-    CTRL_KEY = 17,
-    ENTER_KEY = 13,
-    SPACE_KEY = 32,
-    ESCAPE_KEY = 27
-};
-
-char gStartOfFrame[] = {0xCA, 0xFE, 0xBA, 0xBE, 0, 0, 0, 0};
-const char gEndOfFrame[] = {0xDE, 0xAD, 0xBE, 0xEF};
-// Button frame format:
-// [HEADER][PRESSED][KEY]
-const uint8_t gButtonFrameHeader[] = {0xAB, 0xCD};
-const uint8_t gAckFrame[] = {0xFE, 0xED};
-
-typedef struct uKeyData {
-    bool isPressed;
-    uint8_t key;
-} uKeyData_t;
+#define LINK_TASK_STACK_SIZE    (64 * 1024)
 
 static uDeviceType_t gDeviceType = U_DEVICE_TYPE_SHORT_RANGE;
 static const uNetworkCfgBle_t gNetworkCfg = {
@@ -46,32 +30,30 @@ static const uNetworkCfgBle_t gNetworkCfg = {
 };
 static uDeviceCfg_t gDeviceCfg;
 static volatile bool gIsConnected = false;
-static volatile bool gIsFirstPacket = true;
 static uint16_t gCharHandle = -1;
 static int32_t gSpsChannel = -1;
 static int32_t gMtuSize = 0;
 static uDeviceHandle_t gDeviceHandle;
-static uPortQueueHandle_t gKeyQueueHandle;
-static uint32_t gFrameCount = 0;
-static uint32_t gStartTimeMs = 0;
-static float gElapsedTimeSec = 0.0F;
-
-static uint8_t convertToDoomKey(uint8_t receivedKey);
+static uDoomPipelineCfg_t gPipelineCfg;
+static uDoomSchedule_t gTicSchedule;
+static uint32_t gSessions = 1;
+// Which of them this process is, from 0
+static uint32_t gSession = 0;
 
 static void connectionCallback(int32_t connHandle, char *address, int32_t status,
                                int32_t channel, int32_t mtu, void *pParameters)
 {
     if (status == (int32_t)U_BLE_SPS_CONNECTED) {
-        uBleSpsSetSendTimeout(gDeviceHandle, gSpsChannel, 500);
+        uBleSpsSetSendTimeout(gDeviceHandle, channel, 500);
         gSpsChannel = channel;
         gMtuSize = mtu;
+        uDoomPipelineConnect((uint32_t)mtu);
         gIsConnected = true;
-        printf("Connected to: %s, channel: %d, mtu: %d\n", address, channel, mtu);
+        printf("Session %u connected to: %s, channel: %d, mtu: %d\n", gSession, address, channel, mtu);
     } else if (status == (int32_t)U_BLE_SPS_DISCONNECTED) {
         if (connHandle != U_BLE_SPS_INVALID_HANDLE) {
             gIsConnected = false;
-            gIsFirstPacket = true;
-            printf("Disconnected\n");
+            printf("Session %u disconnected\n", gSession);
         } else {
             printf("Connection attempt failed\n");
         }
@@ -80,16 +62,14 @@ static void connectionCallback(int32_t connHandle, char *address, int32_t status
 
 static void dataAvailableCallback(int32_t channel, void *pParameters)
 {
-    uint8_t buffer[SINGLE_PACKET_SIZE + 1] = {0};
+    uint8_t buffer[SINGLE_PACKET_SIZE];
     uDeviceHandle_t *pDeviceHandle = (uDeviceHandle_t *)pParameters;
-    int32_t length = uBleSpsReceive(*pDeviceHandle, channel, (char *)buffer, sizeof(buffer) - 1);
+    int32_t length;
 
-    if (length >= 4 && buffer[0] == gButtonFrameHeader[0] && buffer[1] == gButtonFrameHeader[1]) {
-        uKeyData_t keyData = {.isPressed = buffer[2], .key = convertToDoomKey(buffer[3])};
-        uPortQueueSend(gKeyQueueHandle, &keyData);
-        //printf("Key pressed: %u, value: %u\n", buffer[2], buffer[3]);
-    } else {
-        printf("Woops... length: %d, buffer[0] = %02X, buffer[1] = %02X\n", length, buffer[0], buffer[1]);
+    // Drain everything the module has buffered, a single notification can
+    // carry several coalesced key frames
+    while ((length = uBleSpsReceive(*pDeviceHandle, channel, (char *)buffer, sizeof(buffer))) > 0) {
+        uDoomInputParse(buffer, (size_t)length, DG_GetTicksMs());
     }
 }
 
@@ -114,8 +94,10 @@ static size_t covertFrameToPng(uint8_t *pPngArray) {
     return pngSize;
 }
 
-static void sendBle(const uint8_t *data, uint32_t size)
+// Has the signature of uDoomPacketSend_t, the pipeline paces the packets
+static void sendBle(const uint8_t *data, size_t size, void *pContext)
 {
+    (void)pContext;
     if (gIsConnected) {
         int32_t bytesSent = 0;
         while (bytesSent < size) {
@@ -124,81 +106,69 @@ static void sendBle(const uint8_t *data, uint32_t size)
     }
 }
 
-static void prepareImageBuffer(uint8_t *pImageBuffer, uint32_t bufferSize) {
-    uint8_t *pScreenBuffer = (uint8_t *)DG_ScreenBuffer;
-    
-    for (uint32_t i = 0; i < bufferSize; i += 4) {
-        pImageBuffer[i] = pScreenBuffer[i + 2];
-        pImageBuffer[i + 1] = pScreenBuffer[i + 1];
-        pImageBuffer[i + 2] = pScreenBuffer[i];
-        pImageBuffer[i + 3] = 0xFF;
+// Forks the session processes once Doom is loaded, the game data and
+// everything else already in memory being shared copy-on-write until a
+// session writes to it. Returns true in each of them, with gSession set, and
+// false in this process once they have all exited, with the exit code to give.
+static bool forkSessions(int *pExitCode)
+{
+    uint32_t running = 0;
+    pid_t hostPid = getpid();
+    int status;
+    pid_t pid;
+
+    *pExitCode = 0;
+    fflush(stdout);
+    for (uint32_t i = 0; i < gSessions; ++i) {
+        pid = fork();
+        if (pid == 0) {
+            // No session outlives the host, nor starts once it is gone: it
+            // may have died before the signal was asked for
+            if ((prctl(PR_SET_PDEATHSIG, SIGTERM) != 0) || (getppid() != hostPid)) {
+                exit(1);
+            }
+            gSession = i;
+            return true;
+        }
+        if (pid < 0) {
+            printf("* Failed to start session %u: %s\n", i, strerror(errno));
+            *pExitCode = 1;
+            break;
+        }
+        ++running;
     }
-}
 
-static uint8_t convertToDoomKey(uint8_t receivedKey)
-{
-    uint8_t key;
-
-    switch (receivedKey) {
-    case ENTER_KEY:
-        key = KEY_ENTER;
-        break;
-    case LEFT_KEY:
-        key = KEY_LEFTARROW;
-        break;
-    case RIGHT_KEY:
-        key = KEY_RIGHTARROW;
-        break;
-    case UP_KEY:
-        key = KEY_UPARROW;
-        break;
-    case DOWN_KEY:
-        key = KEY_DOWNARROW;
-        break;
-    case CTRL_KEY:
-        key = KEY_FIRE;
-        break;
-    case SPACE_KEY:
-        key = KEY_USE;
-        break;
-    case ESCAPE_KEY:
-        key = KEY_ESCAPE;
-        break;
-    default:
-        key = 0xFF;
-        break;
+    for (; (running > 0) && ((pid = wait(&status)) > 0); --running) {
+        printf("Session process %d exited with status %d\n", (int)pid,
+               WIFEXITED(status) ? WEXITSTATUS(status) : -1);
     }
-    
-    return key;
+
+    return false;
 }
 
-void DG_Init()
+// Brings up the module and the BLE network, seconds of UART handshakes, on a
+// task of its own so that Doom loads meanwhile
+static void linkTask(void *pParameter)
 {
     int32_t errorCode;
+    uint64_t startUs = uDoomClockGetUs();
 
-    // Initiate ubxlib
-    uPortInit();
-    uDeviceInit();
-
-    errorCode = uPortQueueCreate(KEY_QUEUE_SIZE, sizeof(uKeyData_t), &gKeyQueueHandle);
-    if (errorCode != 0) { 
-        printf("Failed to create queue: %d\n", errorCode);
-    } else {
-        printf("Key queue created successfully!\n");
-    }
-
-    if (errorCode == 0) {
-        uDeviceGetDefaults(gDeviceType, &gDeviceCfg);
-        gDeviceCfg.deviceCfg.cfgSho.moduleType = U_SHORT_RANGE_MODULE_TYPE_NINA_W15;
-        printf("\nInitiating the module...\n");
-        errorCode = uDeviceOpen(&gDeviceCfg, &gDeviceHandle);
-    }
+    (void)pParameter;
+    uDeviceGetDefaults(gDeviceType, &gDeviceCfg);
+    gDeviceCfg.deviceCfg.cfgSho.moduleType = U_SHORT_RANGE_MODULE_TYPE_NINA_W15;
+    // Every session has a module of its own, on the UARTs after the default one
+    gDeviceCfg.transportCfg.cfgUart.uart += (int32_t)gSession;
+    printf("\nInitiating the module...\n");
+    errorCode = uDeviceOpen(&gDeviceCfg, &gDeviceHandle);
 
     if (errorCode == 0) {
+        printf("Startup: module open in %u ms\n", uDoomClockGetMsSince(startUs));
+        startUs = uDoomClockGetUs();
         printf("Bringing up the BLE network...\n");
         errorCode = uNetworkInterfaceUp(gDeviceHandle, gNetworkCfg.type, &gNetworkCfg);
 
         if (errorCode == 0) {
+            printf("Startup: BLE network up in %u ms\n", uDoomClockGetMsSince(startUs));
             uBleSpsSetCallbackConnectionStatus(gDeviceHandle, connectionCallback, &gDeviceHandle);
             uBleSpsSetDataAvailableCallback(gDeviceHandle, dataAvailableCallback, &gDeviceHandle);
             printf("Waiting for connections...\n");
@@ -208,92 +178,77 @@ void DG_Init()
     } else {
         printf("* Failed to initiate the module: %d\n", errorCode);
     }
+
+    uPortTaskDelete(NULL);
+}
+
+// Starts ubxlib, then linkTask(). With sessions, in each session process:
+// ubxlib's threads wouldn't survive the fork.
+static void startLink(void)
+{
+    uPortTaskHandle_t task;
+
+    // Initiate ubxlib
+    uPortInit();
+    uDeviceInit();
+
+    if (uPortTaskCreate(linkTask, "doomLink", LINK_TASK_STACK_SIZE, NULL,
+                        U_CFG_OS_APP_TASK_PRIORITY, &task) != 0) {
+        printf("* Failed to start the link task\n");
+    }
+}
+
+void DG_Init()
+{
+    // Done by main(), the link may be up before Doom is
 }
 
 void DG_DrawFrame()
 {
     if (gIsConnected) {
-        float fps;
-        uint8_t pImageBuffer[DOOM_FRAME_SIZE];
-        uint8_t *pPngArray;
-        size_t pngSize;
-        uint32_t error;
-
-        prepareImageBuffer(pImageBuffer, DOOM_FRAME_SIZE);
-        error = lodepng_encode32(&pPngArray, &pngSize, pImageBuffer, DOOMGENERIC_RESX, DOOMGENERIC_RESY);
-        if (error) {
-            printf("lodepng error %u: %s\n", error, lodepng_error_text(error));
-            pngSize = 0;
-        }
-        //printf("pngSize = %zu\n", pngSize);
-
-        if (pngSize) {
-            uint32_t packetsToSend = pngSize / gMtuSize;
-            uint32_t remainder = pngSize % gMtuSize;
-            uint32_t offset = 0;
-            uint8_t *pPngSizeArray = (uint8_t *)&pngSize;
-
-            // Copy PNG size in bytes to start of frame - remote will expect that number of bytes
-            gStartOfFrame[4] = pPngSizeArray[3];
-            gStartOfFrame[5] = pPngSizeArray[2];
-            gStartOfFrame[6] = pPngSizeArray[1];
-            gStartOfFrame[7] = pPngSizeArray[0];
-
-            if (gIsFirstPacket) {
-                printf("Waiting a few seconds before sending the first package...\n");
-                DG_SleepMs(5000);
-                gIsFirstPacket = false;
-                gStartTimeMs = DG_GetTicksMs();
-            }
+        uDoomPipelineDrawFrame();
+    }
+}
 
-            sendBle(gStartOfFrame, sizeof(gStartOfFrame));
-            usleep(TX_SLEEP_US);
+uint64_t uDoomClockGetUs(void)
+{
+    struct timespec now;
 
-            for (uint32_t i = 0; i < packetsToSend; ++i) {
-                sendBle(&pPngArray[offset], gMtuSize);
-                offset += gMtuSize;
-                usleep(TX_SLEEP_US);
-            }
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-            if (remainder) {
-                sendBle(&pPngArray[offset], remainder);
-                usleep(TX_SLEEP_US);
-            }
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
 
-            ++gFrameCount;
-            fps = (float)gFrameCount / ((float)(DG_GetTicksMs() - gStartTimeMs) / 1000.0F);
-            printf("FPS: %.2f\n", fps);
-            free(pPngArray);
-        }
-    } else {
-        // Roughly 35 FPS
-        DG_SleepMs(29);
+void uDoomClockSleepUntilUs(uint64_t deadlineUs)
+{
+    struct timespec deadline = {
+        .tv_sec = (time_t)(deadlineUs / 1000000),
+        .tv_nsec = (long)(deadlineUs % 1000000) * 1000
+    };
+
+    // An absolute deadline, so a signal waking us up early costs nothing
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
     }
 }
 
 void DG_SleepMs(uint32_t ms)
 {
-    usleep (ms * 1000);
+    uDoomClockSleepUntilUs(uDoomClockGetUs() + (uint64_t)ms * 1000);
 }
 
 uint32_t DG_GetTicksMs()
 {
-    struct timeval  tp;
-    struct timezone tzp;
-    gettimeofday(&tp, &tzp);
-    /* return milliseconds */
-    return (tp.tv_sec * 1000) + (tp.tv_usec / 1000); 
+    return (uint32_t)(uDoomClockGetUs() / 1000);
 }
 
 int DG_GetKey(int* pressed, unsigned char* doomKey)
 {
     int hasKey = 0;
+    uDoomInputEvent_t event;
 
-    if (uPortQueueGetFree(gKeyQueueHandle) < KEY_QUEUE_SIZE) {
-        uKeyData_t keyData;
-        uPortQueueReceive(gKeyQueueHandle, &keyData);
-        *pressed = (int)keyData.isPressed;
-        *doomKey = (unsigned char)keyData.key;
+    if (uDoomInputPop(&event, DG_GetTicksMs())) {
+        *pressed = (int)event.isPressed;
+        *doomKey = (unsigned char)event.key;
         hasKey = 1;
     }
 
@@ -307,9 +262,64 @@ void DG_SetWindowTitle(const char * title)
 
 int main(int argc, char **argv)
 {
+    int exitCode;
+
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], "-sessions") == 0) {
+            gSessions = (uint32_t)atoi(argv[i + 1]);
+        }
+    }
+    if (gSessions > 1) {
+        // Lines of the sessions would mix if they were buffered, this has to
+        // come before anything is written
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    }
+
+    uDoomPipelineGetDefaults(&gPipelineCfg);
+    gPipelineCfg.startUs = uDoomClockGetUs();
+    if (!uDoomPipelineParseArgs(&gPipelineCfg, argc, argv)) {
+        return 1;
+    }
+    if (gSessions == 0) {
+        printf("* Expected -sessions <count>, 1 or more\n");
+        return 1;
+    }
+    if (gSessions > 1) {
+        // -workers is what the host has to spare, shared out between the
+        // sessions so they don't run more encode threads than that
+        if (gPipelineCfg.workers % gSessions != 0) {
+            printf("* %u workers don't divide between %u sessions, %u left unused\n",
+                   gPipelineCfg.workers, gSessions, gPipelineCfg.workers % gSessions);
+        }
+        gPipelineCfg.workers /= gSessions;
+    }
+
+    uDoomInputInit();
+    if (gSessions == 1) {
+        // The module comes up while Doom loads
+        startLink();
+    }
+
     doomgeneric_Create(argc, argv);
+    printf("Startup: Doom loaded in %u ms\n", uDoomClockGetMsSince(gPipelineCfg.startUs));
+    // Doom keeps its state in globals, so each session is a process of its
+    // own, forked from this one
+    if (gSessions > 1) {
+        if (!forkSessions(&exitCode)) {
+            return exitCode;
+        }
+        startLink();
+    }
+    // After ubxlib, which the workers run on
+    if (!uDoomPipelineInit(&gPipelineCfg, sendBle, NULL)) {
+        printf("* Failed to start %u workers\n", gPipelineCfg.workers);
+        return 1;
+    }
 
+    // Doom runs its tics as they fall due, one loop per tic is all it needs
+    uDoomScheduleInit(&gTicSchedule, 1000000, U_DOOM_TIC_RATE_HZ);
     for (;;) {
+        uDoomScheduleWait(&gTicSchedule);
         if (gIsConnected) {
             doomgeneric_Tick();
         }
@@ -0,0 +1,145 @@
+// WAD file backend mapping the files into memory with mmap(), registered with
+// w_file.c through HAVE_MMAP and used when Doom is started with -mmap. Lumps
+// are then pointers into the mapping rather than copies in the zone, the
+// pages are read from the page cache as they are first touched, and the
+// processes reading the same WAD share them: the sessions of a host, but also
+// separate u-doom processes.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "w_file.h"
+#include "z_zone.h"
+
+typedef struct
+{
+    wad_file_t wad;
+    int handle;
+} posix_wad_file_t;
+
+extern wad_file_class_t posix_wad_file;
+
+// Private and writable, as the stdc backend's copies are: should the game
+// write to a lump, it gets a copy of that page and the file stays as it is
+static void MapFile(posix_wad_file_t *wad, char *path)
+{
+    void *result;
+
+    result = mmap(NULL, wad->wad.length, PROT_READ | PROT_WRITE, MAP_PRIVATE, wad->handle, 0);
+
+    if (result == MAP_FAILED)
+    {
+        // Lumps are read into the zone as with the stdc backend
+        fprintf(stderr, "W_Posix_OpenFile: Unable to mmap() %s: %s\n", path, strerror(errno));
+        wad->wad.mapped = NULL;
+    }
+    else
+    {
+        wad->wad.mapped = result;
+    }
+}
+
+static wad_file_t *W_Posix_OpenFile(char *path)
+{
+    posix_wad_file_t *result;
+    struct stat status;
+    int handle;
+
+    handle = open(path, O_RDONLY);
+
+    if (handle < 0)
+    {
+        return NULL;
+    }
+
+    if (fstat(handle, &status) != 0 || status.st_size == 0)
+    {
+        // Nothing to map, an empty WAD isn't one anyway
+        close(handle);
+        return NULL;
+    }
+
+    result = Z_Malloc(sizeof(posix_wad_file_t), PU_STATIC, 0);
+    result->wad.file_class = &posix_wad_file;
+    result->wad.length = (unsigned int) status.st_size;
+    result->handle = handle;
+
+    MapFile(result, path);
+
+    return &result->wad;
+}
+
+static void W_Posix_CloseFile(wad_file_t *wad)
+{
+    posix_wad_file_t *posix_wad;
+
+    posix_wad = (posix_wad_file_t *) wad;
+
+    if (posix_wad->wad.mapped != NULL)
+    {
+        munmap(posix_wad->wad.mapped, posix_wad->wad.length);
+    }
+
+    close(posix_wad->handle);
+    Z_Free(posix_wad);
+}
+
+// Read data from the specified position in the file into the
+// provided buffer. Returns the number of bytes read.
+
+static size_t W_Posix_Read(wad_file_t *wad, unsigned int offset,
+                           void *buffer, size_t buffer_len)
+{
+    posix_wad_file_t *posix_wad;
+    size_t bytes_read;
+    ssize_t result;
+
+    posix_wad = (posix_wad_file_t *) wad;
+
+    if (posix_wad->wad.mapped != NULL)
+    {
+        // A copy out of the mapping, for the few callers that want one
+        if (offset >= posix_wad->wad.length)
+        {
+            return 0;
+        }
+        if (buffer_len > posix_wad->wad.length - offset)
+        {
+            buffer_len = posix_wad->wad.length - offset;
+        }
+        memcpy(buffer, posix_wad->wad.mapped + offset, buffer_len);
+        return buffer_len;
+    }
+
+    bytes_read = 0;
+
+    while (bytes_read < buffer_len)
+    {
+        result = pread(posix_wad->handle, (char *) buffer + bytes_read,
+                       buffer_len - bytes_read, (off_t) offset + bytes_read);
+
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            break;
+        }
+
+        bytes_read += (size_t) result;
+    }
+
+    return bytes_read;
+}
+
+wad_file_class_t posix_wad_file =
+{
+    W_Posix_OpenFile,
+    W_Posix_CloseFile,
+    W_Posix_Read,
+};
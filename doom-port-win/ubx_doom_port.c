@@ -1,12 +1,16 @@
 #include <windows.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sysinfoapi.h>
 #include "ubxlib.h"
 #include "doomkeys.h"
 #include "doomgeneric.h"
 #include "lodepng.h"
+#include "ubx_doom_clock.h"
+#include "ubx_doom_input.h"
+#include "ubx_doom_pipeline.h"
 #include "usleep.h"
 
 // X * Y * 4 (RGBA size)
@@ -14,31 +18,7 @@
 #define SINGLE_PACKET_SIZE      244
 #define SEMAPHORE_TIMEOUT_MS    1000
 #define TX_SLEEP_MS             1
-#define TX_SLEEP_US             3000
-#define KEY_QUEUE_SIZE          100
-
-enum { 
-    UP_KEY = 38,
-    DOWN_KEY = 40,
-    LEFT_KEY = 37,
-    RIGHT_KEY = 39,
-    CTRL_KEY = 17,
-    ENTER_KEY = 13,
-    SPACE_KEY = 32,
-    ESCAPE_KEY = 27
-};
-
-char gStartOfFrame[] = {0xCA, 0xFE, 0xBA, 0xBE, 0, 0, 0, 0};
-const char gEndOfFrame[] = {0xDE, 0xAD, 0xBE, 0xEF};
-// Button frame format:
-// [HEADER][PRESSED][KEY]
-const uint8_t gButtonFrameHeader[] = {0xAB, 0xCD};
-const uint8_t gAckFrame[] = {0xFE, 0xED};
-
-typedef struct uKeyData {
-    bool isPressed;
-    uint8_t key;
-} uKeyData_t;
+#define LINK_TASK_STACK_SIZE    (64 * 1024)
 
 static uDeviceType_t gDeviceType = U_DEVICE_TYPE_SHORT_RANGE;
 static const uNetworkCfgBle_t gNetworkCfg = {
@@ -48,32 +28,28 @@ static const uNetworkCfgBle_t gNetworkCfg = {
 };
 static uDeviceCfg_t gDeviceCfg;
 static volatile bool gIsConnected = false;
-static volatile bool gIsFirstPacket = true;
 static uint16_t gCharHandle = -1;
 static int32_t gSpsChannel = -1;
 static int32_t gMtuSize = 0;
 static uDeviceHandle_t gDeviceHandle;
-static uPortQueueHandle_t gKeyQueueHandle;
-static uint32_t gFrameCount = 0;
-static uint32_t gStartTimeMs = 0;
-static float gElapsedTimeSec = 0.0F;
+static uDoomPipelineCfg_t gPipelineCfg;
+static uDoomSchedule_t gTicSchedule;
+static uint32_t gSessions = 1;
 //static uPortSemaphoreHandle_t gTxSem;
 
-static uint8_t convertToDoomKey(uint8_t receivedKey);
-
 static void connectionCallback(int32_t connHandle, char *address, int32_t status,
                                int32_t channel, int32_t mtu, void *pParameters)
 {
     if (status == (int32_t)U_BLE_SPS_CONNECTED) {
-        uBleSpsSetSendTimeout(gDeviceHandle, gSpsChannel, 500);
+        uBleSpsSetSendTimeout(gDeviceHandle, channel, 500);
         gSpsChannel = channel;
         gMtuSize = mtu;
+        uDoomPipelineConnect((uint32_t)mtu);
         gIsConnected = true;
         printf("Connected to: %s, channel: %d, mtu: %d\n", address, channel, mtu);
     } else if (status == (int32_t)U_BLE_SPS_DISCONNECTED) {
         if (connHandle != U_BLE_SPS_INVALID_HANDLE) {
             gIsConnected = false;
-            gIsFirstPacket = true;
             printf("Disconnected\n");
         } else {
             printf("Connection attempt failed\n");
@@ -83,16 +59,14 @@ static void connectionCallback(int32_t connHandle, char *address, int32_t status
 
 static void dataAvailableCallback(int32_t channel, void *pParameters)
 {
-    uint8_t buffer[SINGLE_PACKET_SIZE + 1] = {0};
+    uint8_t buffer[SINGLE_PACKET_SIZE];
     uDeviceHandle_t *pDeviceHandle = (uDeviceHandle_t *)pParameters;
-    int32_t length = uBleSpsReceive(*pDeviceHandle, channel, (char *)buffer, sizeof(buffer) - 1);
+    int32_t length;
 
-    if (length >= 4 && buffer[0] == gButtonFrameHeader[0] && buffer[1] == gButtonFrameHeader[1]) {
-        uKeyData_t keyData = {.isPressed = buffer[2], .key = convertToDoomKey(buffer[3])};
-        uPortQueueSend(gKeyQueueHandle, &keyData);
-        //printf("Key pressed: %u, value: %u\n", buffer[2], buffer[3]);
-    } else {
-        printf("Woops... length: %d, buffer[0] = %02X, buffer[1] = %02X\n", length, buffer[0], buffer[1]);
+    // Drain everything the module has buffered, a single notification can
+    // carry several coalesced key frames
+    while ((length = uBleSpsReceive(*pDeviceHandle, channel, (char *)buffer, sizeof(buffer))) > 0) {
+        uDoomInputParse(buffer, (size_t)length, DG_GetTicksMs());
     }
 }
 
@@ -117,8 +91,10 @@ static size_t covertFrameToPng(uint8_t *pPngArray) {
     return pngSize;
 }
 
-static void sendBle(const uint8_t *data, uint32_t size)
+// Has the signature of uDoomPacketSend_t, the pipeline paces the packets
+static void sendBle(const uint8_t *data, size_t size, void *pContext)
 {
+    (void)pContext;
     if (gIsConnected) {
         int32_t bytesSent = 0;
         while (bytesSent < size) {
@@ -127,57 +103,45 @@ static void sendBle(const uint8_t *data, uint32_t size)
     }
 }
 
-static void prepareImageBuffer(uint8_t *pImageBuffer, uint32_t bufferSize) {
-    uint8_t *pScreenBuffer = (uint8_t *)DG_ScreenBuffer;
-    
-    for (uint32_t i = 0; i < bufferSize; i += 4) {
-        pImageBuffer[i] = pScreenBuffer[i + 2];
-        pImageBuffer[i + 1] = pScreenBuffer[i + 1];
-        pImageBuffer[i + 2] = pScreenBuffer[i];
-        pImageBuffer[i + 3] = 0xFF;
-    }
-}
-
-static uint8_t convertToDoomKey(uint8_t receivedKey)
+// Brings up the module and the BLE network, seconds of UART handshakes, on a
+// task of its own so that Doom loads meanwhile
+static void linkTask(void *pParameter)
 {
-    uint8_t key;
-
-    switch (receivedKey) {
-    case ENTER_KEY:
-        key = KEY_ENTER;
-        break;
-    case LEFT_KEY:
-        key = KEY_LEFTARROW;
-        break;
-    case RIGHT_KEY:
-        key = KEY_RIGHTARROW;
-        break;
-    case UP_KEY:
-        key = KEY_UPARROW;
-        break;
-    case DOWN_KEY:
-        key = KEY_DOWNARROW;
-        break;
-    case CTRL_KEY:
-        key = KEY_FIRE;
-        break;
-    case SPACE_KEY:
-        key = KEY_USE;
-        break;
-    case ESCAPE_KEY:
-        key = KEY_ESCAPE;
-        break;
-    default:
-        key = 0xFF;
-        break;
+    int32_t errorCode;
+    uint64_t startUs = uDoomClockGetUs();
+
+    (void)pParameter;
+    uDeviceGetDefaults(gDeviceType, &gDeviceCfg);
+    gDeviceCfg.deviceCfg.cfgSho.moduleType = U_SHORT_RANGE_MODULE_TYPE_NINA_W15;
+    printf("\nInitiating the module...\n");
+    errorCode = uDeviceOpen(&gDeviceCfg, &gDeviceHandle);
+
+    if (errorCode == 0) {
+        printf("Startup: module open in %u ms\n", uDoomClockGetMsSince(startUs));
+        startUs = uDoomClockGetUs();
+        printf("Bringing up the BLE network...\n");
+        errorCode = uNetworkInterfaceUp(gDeviceHandle, gNetworkCfg.type, &gNetworkCfg);
+
+        if (errorCode == 0) {
+            printf("Startup: BLE network up in %u ms\n", uDoomClockGetMsSince(startUs));
+            uBleSpsSetCallbackConnectionStatus(gDeviceHandle, connectionCallback, &gDeviceHandle);
+            uBleSpsSetDataAvailableCallback(gDeviceHandle, dataAvailableCallback, &gDeviceHandle);
+            printf("Waiting for connections...\n");
+        } else {
+            printf("* Failed to bring up the network: %d\n", errorCode);
+        }
+    } else {
+        printf("* Failed to initiate the module: %d\n", errorCode);
     }
-    
-    return key;
+
+    uPortTaskDelete(NULL);
 }
 
-void DG_Init()
+// Starts ubxlib, then linkTask()
+static void startLink(void)
 {
-    int32_t errorCode;
+    uPortTaskHandle_t task;
+
     // Remove the line below if you want the log printouts from ubxlib
     //uPortLogOff();
 
@@ -190,114 +154,68 @@ void DG_Init()
     //     printf("Failed to create semaphore: %d\n", errorCode);
     // }
 
-    errorCode = uPortQueueCreate(KEY_QUEUE_SIZE, sizeof(uKeyData_t), &gKeyQueueHandle);
-    if (errorCode != 0) { 
-        printf("Failed to create queue: %d\n", errorCode);
+    if (uPortTaskCreate(linkTask, "doomLink", LINK_TASK_STACK_SIZE, NULL,
+                        U_CFG_OS_APP_TASK_PRIORITY, &task) != 0) {
+        printf("* Failed to start the link task\n");
     }
+}
 
-    if (errorCode == 0) {
-        uDeviceGetDefaults(gDeviceType, &gDeviceCfg);
-        gDeviceCfg.deviceCfg.cfgSho.moduleType = U_SHORT_RANGE_MODULE_TYPE_NINA_W15;
-        printf("\nInitiating the module...\n");
-        errorCode = uDeviceOpen(&gDeviceCfg, &gDeviceHandle);
+void DG_Init()
+{
+    // Done by main(), the link may be up before Doom is
+}
+
+void DG_DrawFrame()
+{
+    if (gIsConnected) {
+        uDoomPipelineDrawFrame();
     }
+}
 
-    if (errorCode == 0) {
-        printf("Bringing up the BLE network...\n");
-        errorCode = uNetworkInterfaceUp(gDeviceHandle, gNetworkCfg.type, &gNetworkCfg);
+uint64_t uDoomClockGetUs(void)
+{
+    static LARGE_INTEGER frequency = {0};
+    LARGE_INTEGER counter;
 
-        if (errorCode == 0) {
-            uBleSpsSetCallbackConnectionStatus(gDeviceHandle, connectionCallback, &gDeviceHandle);
-            uBleSpsSetDataAvailableCallback(gDeviceHandle, dataAvailableCallback, &gDeviceHandle);
-            printf("Waiting for connections...\n");
-        } else {
-            printf("* Failed to bring up the network: %d\n", errorCode);
-        }
-    } else {
-        printf("* Failed to initiate the module: %d\n", errorCode);
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
     }
+    QueryPerformanceCounter(&counter);
+
+    // In two steps, the counter times a million would overflow
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+           (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / (uint64_t)frequency.QuadPart;
 }
 
-void DG_DrawFrame()
+void uDoomClockSleepUntilUs(uint64_t deadlineUs)
 {
-    if (gIsConnected) {
-        float fps;
-        uint8_t pImageBuffer[DOOM_FRAME_SIZE];
-        uint8_t *pPngArray;
-        size_t pngSize;
-        uint32_t error;
-
-        prepareImageBuffer(pImageBuffer, DOOM_FRAME_SIZE);
-        error = lodepng_encode32(&pPngArray, &pngSize, pImageBuffer, DOOMGENERIC_RESX, DOOMGENERIC_RESY);
-        if (error) {
-            printf("lodepng error %u: %s\n", error, lodepng_error_text(error));
-            pngSize = 0;
-        }
-        //printf("pngSize = %zu\n", pngSize);
-
-        if (pngSize) {
-            uint32_t packetsToSend = pngSize / gMtuSize;
-            uint32_t remainder = pngSize % gMtuSize;
-            uint32_t offset = 0;
-            uint8_t *pPngSizeArray = (uint8_t *)&pngSize;
-
-            // Copy PNG size in bytes to start of frame - remote will expect that number of bytes
-            gStartOfFrame[4] = pPngSizeArray[3];
-            gStartOfFrame[5] = pPngSizeArray[2];
-            gStartOfFrame[6] = pPngSizeArray[1];
-            gStartOfFrame[7] = pPngSizeArray[0];
-
-            if (gIsFirstPacket) {
-                printf("Waiting a few seconds before sending the first package...\n");
-                DG_SleepMs(5000);
-                gIsFirstPacket = false;
-                gStartTimeMs = DG_GetTicksMs();
-            }
-
-            sendBle(gStartOfFrame, sizeof(gStartOfFrame));
-            usleep(TX_SLEEP_US);
-
-            for (uint32_t i = 0; i < packetsToSend; ++i) {
-                sendBle(&pPngArray[offset], gMtuSize);
-                offset += gMtuSize;
-                usleep(TX_SLEEP_US);
-            }
-
-            if (remainder) {
-                sendBle(&pPngArray[offset], remainder);
-                usleep(TX_SLEEP_US);
-            }
-
-            ++gFrameCount;
-            fps = (float)gFrameCount / ((float)(DG_GetTicksMs() - gStartTimeMs) / 1000.0F);
-            printf("FPS: %.2f\n", fps);
-            free(pPngArray);
-        }
-    } else {
-        // Roughly 35 FPS
-        DG_SleepMs(29);
+    uint64_t nowUs = uDoomClockGetUs();
+
+    // No absolute mode for the monotonic clock, the remaining time is taken
+    // from the deadline every time so the inaccuracies still don't add up
+    if (deadlineUs > nowUs) {
+        usleep((long long)(deadlineUs - nowUs));
     }
 }
 
 void DG_SleepMs(uint32_t ms)
 {
-    Sleep(ms);
+    uDoomClockSleepUntilUs(uDoomClockGetUs() + (uint64_t)ms * 1000);
 }
 
 uint32_t DG_GetTicksMs()
 {
-    return GetTickCount();
+    return (uint32_t)(uDoomClockGetUs() / 1000);
 }
 
 int DG_GetKey(int* pressed, unsigned char* doomKey)
 {
     int hasKey = 0;
+    uDoomInputEvent_t event;
 
-    if (uPortQueueGetFree(gKeyQueueHandle) < KEY_QUEUE_SIZE) {
-        uKeyData_t keyData;
-        uPortQueueReceive(gKeyQueueHandle, &keyData);
-        *pressed = (int)keyData.isPressed;
-        *doomKey = (unsigned char)keyData.key;
+    if (uDoomInputPop(&event, DG_GetTicksMs())) {
+        *pressed = (int)event.isPressed;
+        *doomKey = (unsigned char)event.key;
         hasKey = 1;
     }
 
@@ -311,9 +229,38 @@ void DG_SetWindowTitle(const char * title)
 
 int main(int argc, char **argv)
 {
+    uDoomPipelineGetDefaults(&gPipelineCfg);
+    gPipelineCfg.startUs = uDoomClockGetUs();
+    if (!uDoomPipelineParseArgs(&gPipelineCfg, argc, argv)) {
+        return 1;
+    }
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], "-sessions") == 0) {
+            gSessions = (uint32_t)atoi(argv[i + 1]);
+        }
+    }
+    if (gSessions != 1) {
+        // Doom keeps its state in globals, sessions need a process each
+        printf("* -sessions needs fork(), only the Linux port has it\n");
+        return 1;
+    }
+
+    uDoomInputInit();
+    // The module comes up while Doom loads
+    startLink();
+
     doomgeneric_Create(argc, argv);
+    printf("Startup: Doom loaded in %u ms\n", uDoomClockGetMsSince(gPipelineCfg.startUs));
+    // After ubxlib, which the workers run on
+    if (!uDoomPipelineInit(&gPipelineCfg, sendBle, NULL)) {
+        printf("* Failed to start %u workers\n", gPipelineCfg.workers);
+        return 1;
+    }
 
+    // Doom runs its tics as they fall due, one loop per tic is all it needs
+    uDoomScheduleInit(&gTicSchedule, 1000000, U_DOOM_TIC_RATE_HZ);
     for (;;) {
+        uDoomScheduleWait(&gTicSchedule);
         if (gIsConnected) {
             doomgeneric_Tick();
         }
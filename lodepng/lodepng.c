@@ -174,7 +174,7 @@ Often in case of an error a value is assigned to a variable and then it breaks
 out of a loop (to go to the cleanup phase of a function). This macro does that.
 It makes the error handling code shorter and more readable.
 
-Example: if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83);
+Example: if(!ucvector_resize(out, out->size + 1)) ERROR_BREAK(83);
 */
 #define CERROR_BREAK(errorvar, code){\
   errorvar = code;\
@@ -203,7 +203,7 @@ Example: if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83);
 }
 
 /*
-About uivector, ucvector and string:
+About ucvector and string:
 -All of them wrap dynamic arrays or text strings in a similar way.
 -LodePNG was originally written in C++. The vectors replace the std::vectors that were used in the C++ version.
 -The string tools are made to avoid problems with compilers that declare things like strncat as deprecated.
@@ -211,50 +211,6 @@ About uivector, ucvector and string:
 -As with many other structs in this file, the init and cleanup functions serve as ctor and dtor.
 */
 
-#ifdef LODEPNG_COMPILE_ZLIB
-#ifdef LODEPNG_COMPILE_ENCODER
-/*dynamic vector of unsigned ints*/
-typedef struct uivector {
-  unsigned* data;
-  size_t size; /*size in number of unsigned longs*/
-  size_t allocsize; /*allocated size in bytes*/
-} uivector;
-
-static void uivector_cleanup(void* p) {
-  ((uivector*)p)->size = ((uivector*)p)->allocsize = 0;
-  lodepng_free(((uivector*)p)->data);
-  ((uivector*)p)->data = NULL;
-}
-
-/*returns 1 if success, 0 if failure ==> nothing done*/
-static unsigned uivector_resize(uivector* p, size_t size) {
-  size_t allocsize = size * sizeof(unsigned);
-  if(allocsize > p->allocsize) {
-    size_t newsize = allocsize + (p->allocsize >> 1u);
-    void* data = lodepng_realloc(p->data, newsize);
-    if(data) {
-      p->allocsize = newsize;
-      p->data = (unsigned*)data;
-    }
-    else return 0; /*error: not enough memory*/
-  }
-  p->size = size;
-  return 1; /*success*/
-}
-
-static void uivector_init(uivector* p) {
-  p->data = NULL;
-  p->size = p->allocsize = 0;
-}
-
-/*returns 1 if success, 0 if failure ==> nothing done*/
-static unsigned uivector_push_back(uivector* p, unsigned c) {
-  if(!uivector_resize(p, p->size + 1)) return 0;
-  p->data[p->size - 1] = c;
-  return 1;
-}
-#endif /*LODEPNG_COMPILE_ENCODER*/
-#endif /*LODEPNG_COMPILE_ZLIB*/
 
 /* /////////////////////////////////////////////////////////////////////////// */
 
@@ -411,47 +367,69 @@ unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const
 #ifdef LODEPNG_COMPILE_ZLIB
 #ifdef LODEPNG_COMPILE_ENCODER
 
+/*Bits are gathered in a size_t and go to the output half of it at a time, which
+is 32 bits with a 64-bit size_t. Between writes there are less than that many
+bits pending, so a write of up to 16 bits always fits.*/
+#define BITWRITER_FLUSH_BITS (sizeof(size_t) * 4u)
+#define BITWRITER_FLUSH_BYTES (sizeof(size_t) / 2u)
+
 typedef struct {
   ucvector* data;
-  unsigned char bp; /*ok to overflow, indicates bit pos inside byte*/
+  size_t buffer; /*the pending bits, the first to be written in the LSBs*/
+  unsigned numbits; /*amount of pending bits*/
+  unsigned error; /*set if the output couldn't grow, the bits written after that are lost*/
 } LodePNGBitWriter;
 
 static void LodePNGBitWriter_init(LodePNGBitWriter* writer, ucvector* data) {
   writer->data = data;
-  writer->bp = 0;
+  writer->buffer = 0;
+  writer->numbits = 0;
+  writer->error = 0;
 }
 
-/*TODO: this ignores potential out of memory errors*/
-#define WRITEBIT(writer, bit){\
-  /* append new byte */\
-  if(((writer->bp) & 7u) == 0) {\
-    if(!ucvector_resize(writer->data, writer->data->size + 1)) return;\
-    writer->data->data[writer->data->size - 1] = 0;\
-  }\
-  (writer->data->data[writer->data->size - 1]) |= (bit << ((writer->bp) & 7u));\
-  ++writer->bp;\
+/*makes sure the next size bytes can be written without growing the output*/
+static void reserveBits(LodePNGBitWriter* writer, size_t size) {
+  if(writer->data->size + size > writer->data->allocsize) {
+    if(!ucvector_reserve(writer->data, writer->data->size + size)) writer->error = 83; /*alloc fail*/
+  }
 }
 
-/* LSB of value is written first, and LSB of bytes is used first */
-static void writeBits(LodePNGBitWriter* writer, unsigned value, size_t nbits) {
-  if(nbits == 1) { /* compiler should statically compile this case if nbits == 1 */
-    WRITEBIT(writer, value);
-  } else {
-    /* TODO: increase output size only once here rather than in each WRITEBIT */
-    size_t i;
-    for(i = 0; i != nbits; ++i) {
-      WRITEBIT(writer, (unsigned char)((value >> i) & 1));
-    }
+static void flushBits(LodePNGBitWriter* writer) {
+  size_t i;
+  reserveBits(writer, BITWRITER_FLUSH_BYTES);
+  if(!writer->error) {
+    unsigned char* out = writer->data->data + writer->data->size;
+    /*compilers turn this into a single store on little endian machines*/
+    for(i = 0; i != BITWRITER_FLUSH_BYTES; ++i) out[i] = (unsigned char)(writer->buffer >> (i * 8u));
+    writer->data->size += BITWRITER_FLUSH_BYTES;
   }
+  writer->buffer >>= BITWRITER_FLUSH_BITS;
+  writer->numbits -= BITWRITER_FLUSH_BITS;
+}
+
+/* LSB of value is written first, and LSB of bytes is used first. At most 16 bits, value must not
+have bits set above them */
+static void writeBits(LodePNGBitWriter* writer, unsigned value, size_t nbits) {
+  writer->buffer |= (size_t)value << writer->numbits;
+  writer->numbits += (unsigned)nbits;
+  if(writer->numbits >= BITWRITER_FLUSH_BITS) flushBits(writer);
 }
 
-/* This one is to use for adding huffman symbol, the value bits are written MSB first */
-static void writeBitsReversed(LodePNGBitWriter* writer, unsigned value, size_t nbits) {
+/* Huffman symbols are written MSB first, HuffmanTree keeps their codes reversed for this */
+#define writeHuffmanSymbol(writer, tree, symbol) writeBits(writer, (tree)->codes[symbol], (tree)->lengths[symbol])
+
+/*writes the pending bits, the last byte padded with zeros. Returns the error, if any*/
+static unsigned writeBitsEnd(LodePNGBitWriter* writer) {
+  size_t numbytes = (writer->numbits + 7u) / 8u;
   size_t i;
-  for(i = 0; i != nbits; ++i) {
-    /* TODO: increase output size only once here rather than in each WRITEBIT */
-    WRITEBIT(writer, (unsigned char)((value >> (nbits - 1u - i)) & 1u));
+  reserveBits(writer, numbytes);
+  if(!writer->error) {
+    for(i = 0; i != numbytes; ++i) writer->data->data[writer->data->size + i] = (unsigned char)(writer->buffer >> (i * 8u));
+    writer->data->size += numbytes;
   }
+  writer->buffer = 0;
+  writer->numbits = 0;
+  return writer->error;
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
@@ -629,7 +607,7 @@ static const unsigned CLCL_ORDER[NUM_CODE_LENGTH_CODES]
 Huffman tree struct, containing multiple representations of the tree
 */
 typedef struct HuffmanTree {
-  unsigned* codes; /*the huffman codes (bit patterns representing the symbols)*/
+  unsigned* codes; /*the huffman codes (bit patterns representing the symbols), bit reversed: the first bit is the LSB*/
   unsigned* lengths; /*the lengths of the huffman codes*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
   unsigned numcodes; /*number of symbols in the alphabet = number of codes*/
@@ -671,12 +649,11 @@ static unsigned HuffmanTree_makeTable(HuffmanTree* tree) {
   /* compute maxlens: max total bit length of symbols sharing prefix in the first table*/
   lodepng_memset(maxlens, 0, headsize * sizeof(*maxlens));
   for(i = 0; i < tree->numcodes; i++) {
-    unsigned symbol = tree->codes[i];
     unsigned l = tree->lengths[i];
     unsigned index;
     if(l <= FIRSTBITS) continue; /*symbols that fit in first table don't increase secondary table size*/
-    /*get the FIRSTBITS MSBs, the MSBs of the symbol are encoded first. See later comment about the reversing*/
-    index = reverseBits(symbol >> (l - FIRSTBITS), FIRSTBITS);
+    /*get the FIRSTBITS MSBs, the MSBs of the symbol are encoded first: the LSBs of the reversed code*/
+    index = tree->codes[i] & mask;
     maxlens[index] = LODEPNG_MAX(maxlens[index], l);
   }
   /* compute total table size: size of first table plus all secondary tables for symbols longer than FIRSTBITS */
@@ -710,11 +687,10 @@ static unsigned HuffmanTree_makeTable(HuffmanTree* tree) {
   numpresent = 0;
   for(i = 0; i < tree->numcodes; ++i) {
     unsigned l = tree->lengths[i];
-    unsigned symbol, reverse;
+    unsigned reverse;
     if(l == 0) continue;
-    symbol = tree->codes[i]; /*the huffman bit pattern. i itself is the value.*/
-    /*reverse bits, because the huffman bits are given in MSB first order but the bit reader reads LSB first*/
-    reverse = reverseBits(symbol, l);
+    /*the huffman bit pattern, already reversed for the LSB first bit reader. i itself is the value.*/
+    reverse = tree->codes[i];
     numpresent++;
 
     if(l <= FIRSTBITS) {
@@ -804,9 +780,9 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree) {
     /*step 3: generate all the codes*/
     for(n = 0; n != tree->numcodes; ++n) {
       if(tree->lengths[n] != 0) {
-        tree->codes[n] = nextcode[tree->lengths[n]]++;
-        /*remove superfluous bits from the code*/
-        tree->codes[n] &= ((1u << tree->lengths[n]) - 1u);
+        /*remove superfluous bits from the code, and reverse it: the bit streams are LSB first*/
+        tree->codes[n] = reverseBits(nextcode[tree->lengths[n]]++ & ((1u << tree->lengths[n]) - 1u),
+                                     tree->lengths[n]);
       }
     }
   }
@@ -1457,33 +1433,73 @@ static size_t searchCodeIndex(const unsigned* array, size_t array_size, size_t v
   return left;
 }
 
-static void addLengthDistance(uivector* values, size_t length, size_t distance) {
-  /*values in encoded vector are those used by deflate:
-  0-255: literal bytes
-  256: end
-  257-285: length/distance pair (length code, followed by extra length bits, distance code, extra distance bits)
-  286-287: invalid*/
+/*A literal, or a length/distance pair, as found by encodeLZ77. The codes and extra bits are only worked out
+when writing it*/
+typedef struct {
+  unsigned short litlen; /*0-255: literal byte, 259-514: 256 + the length of a length/distance pair*/
+  unsigned short dist; /*the distance of a length/distance pair*/
+} LZ77Symbol;
+
+/*The symbols of a block, and the frequencies of the codes they will be written with, counted as the symbols are
+added. There is at most one symbol per input byte, so the symbols never need more room than the largest block.*/
+typedef struct {
+  LZ77Symbol* symbols;
+  size_t size;
+  unsigned frequencies_ll[286];
+  unsigned frequencies_d[30];
+  unsigned char length_code[259]; /*length code index of each length*/
+  unsigned char dist_code[512]; /*distance code index of distances 1-256, then of the larger ones by steps of 128*/
+} LZ77Block;
+
+static unsigned LZ77Block_init(LZ77Block* block, size_t maxblocksize) {
+  size_t i;
+  block->symbols = (LZ77Symbol*)lodepng_malloc(maxblocksize * sizeof(*block->symbols));
+  if(!block->symbols) return 83; /*alloc fail*/
+  block->size = 0;
+  for(i = 3; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) {
+    block->length_code[i] = (unsigned char)searchCodeIndex(LENGTHBASE, 29, i);
+  }
+  for(i = 1; i <= 256; ++i) block->dist_code[i - 1] = (unsigned char)searchCodeIndex(DISTANCEBASE, 30, i);
+  /*the distance codes above 256 all have 7 or more extra bits*/
+  for(i = 2; i != 256; ++i) block->dist_code[256 + i] = (unsigned char)searchCodeIndex(DISTANCEBASE, 30, (i << 7u) + 1u);
+  return 0;
+}
 
-  unsigned length_code = (unsigned)searchCodeIndex(LENGTHBASE, 29, length);
-  unsigned extra_length = (unsigned)(length - LENGTHBASE[length_code]);
-  unsigned dist_code = (unsigned)searchCodeIndex(DISTANCEBASE, 30, distance);
-  unsigned extra_distance = (unsigned)(distance - DISTANCEBASE[dist_code]);
+static void LZ77Block_cleanup(LZ77Block* block) {
+  lodepng_free(block->symbols);
+}
 
-  size_t pos = values->size;
-  /*TODO: return error when this fails (out of memory)*/
-  unsigned ok = uivector_resize(values, values->size + 4);
-  if(ok) {
-    values->data[pos + 0] = length_code + FIRST_LENGTH_CODE_INDEX;
-    values->data[pos + 1] = extra_length;
-    values->data[pos + 2] = dist_code;
-    values->data[pos + 3] = extra_distance;
-  }
+static void LZ77Block_clear(LZ77Block* block) {
+  block->size = 0;
+  lodepng_memset(block->frequencies_ll, 0, sizeof(block->frequencies_ll));
+  lodepng_memset(block->frequencies_d, 0, sizeof(block->frequencies_d));
+}
+
+static unsigned LZ77Block_distCode(const LZ77Block* block, unsigned distance) {
+  return block->dist_code[distance <= 256 ? distance - 1u : 256u + ((distance - 1u) >> 7u)];
+}
+
+static void LZ77Block_addLiteral(LZ77Block* block, unsigned char c) {
+  LZ77Symbol* symbol = &block->symbols[block->size++];
+  symbol->litlen = c;
+  symbol->dist = 0;
+  ++block->frequencies_ll[c];
 }
 
-/*3 bytes of data get encoded into two bytes. The hash cannot use more than 3
-bytes as input because 3 is the minimum match length for deflate*/
-static const unsigned HASH_NUM_VALUES = 65536;
-static const unsigned HASH_BIT_MASK = 65535; /*HASH_NUM_VALUES - 1, but C90 does not like that as initializer*/
+static void LZ77Block_addLengthDistance(LZ77Block* block, unsigned length, unsigned distance) {
+  LZ77Symbol* symbol = &block->symbols[block->size++];
+  symbol->litlen = (unsigned short)(256u + length);
+  symbol->dist = (unsigned short)distance;
+  ++block->frequencies_ll[FIRST_LENGTH_CODE_INDEX + block->length_code[length]];
+  ++block->frequencies_d[LZ77Block_distCode(block, distance)];
+}
+
+/*4 bytes of data get hashed into 14 bits. Hashing 4 instead of 3 bytes misses some matches of
+the minimum length, but those rarely pay off and the chains get shorter. A larger table mostly
+adds cache misses. Runs of a repeated byte all hash the same, so they also get a separate chain
+by run length.*/
+static const unsigned HASH_NUM_VALUES = 16384;
+static const unsigned HASH_BIT_MASK = 16383; /*HASH_NUM_VALUES - 1, but C90 does not like that as initializer*/
 
 typedef struct Hash {
   int* head; /*hash value to head circular pos - can be outdated if went around window*/
@@ -1491,11 +1507,10 @@ typedef struct Hash {
   unsigned short* chain;
   int* val; /*circular pos to hash value*/
 
-  /*TODO: do this not only for zeros but for any repeated byte. However for PNG
-  it's always going to be the zeros that dominate, so not important for PNG*/
-  int* headz; /*similar to head, but for chainz*/
-  unsigned short* chainz; /*those with same amount of zeros*/
-  unsigned short* zeros; /*length of zeros streak, used as a second hash chain*/
+  /*For PNG it's mostly runs of zeros, but flat colors without a Sub filter give runs of any byte*/
+  int* headr; /*similar to head, but for chainr*/
+  unsigned short* chainr; /*those with the same run length*/
+  unsigned short* runs; /*length of the repeated byte streak, used as a second hash chain*/
 } Hash;
 
 static unsigned hash_init(Hash* hash, unsigned windowsize) {
@@ -1504,11 +1519,11 @@ static unsigned hash_init(Hash* hash, unsigned windowsize) {
   hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
   hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
 
-  hash->zeros = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
-  hash->headz = (int*)lodepng_malloc(sizeof(int) * (MAX_SUPPORTED_DEFLATE_LENGTH + 1));
-  hash->chainz = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
+  hash->runs = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
+  hash->headr = (int*)lodepng_malloc(sizeof(int) * (MAX_SUPPORTED_DEFLATE_LENGTH + 1));
+  hash->chainr = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
 
-  if(!hash->head || !hash->chain || !hash->val  || !hash->headz|| !hash->chainz || !hash->zeros) {
+  if(!hash->head || !hash->chain || !hash->val  || !hash->headr|| !hash->chainr || !hash->runs) {
     return 83; /*alloc fail*/
   }
 
@@ -1517,8 +1532,8 @@ static unsigned hash_init(Hash* hash, unsigned windowsize) {
   for(i = 0; i != windowsize; ++i) hash->val[i] = -1;
   for(i = 0; i != windowsize; ++i) hash->chain[i] = i; /*same value as index indicates uninitialized*/
 
-  for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->chainz[i] = i; /*same value as index indicates uninitialized*/
+  for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headr[i] = -1;
+  for(i = 0; i != windowsize; ++i) hash->chainr[i] = i; /*same value as index indicates uninitialized*/
 
   return 0;
 }
@@ -1528,23 +1543,20 @@ static void hash_cleanup(Hash* hash) {
   lodepng_free(hash->val);
   lodepng_free(hash->chain);
 
-  lodepng_free(hash->zeros);
-  lodepng_free(hash->headz);
-  lodepng_free(hash->chainz);
+  lodepng_free(hash->runs);
+  lodepng_free(hash->headr);
+  lodepng_free(hash->chainr);
 }
 
 
 
 static unsigned getHash(const unsigned char* data, size_t size, size_t pos) {
   unsigned result = 0;
-  if(pos + 2 < size) {
-    /*A simple shift and xor hash is used. Since the data of PNGs is dominated
-    by zeroes due to the filters, a better hash does not have a significant
-    effect on speed in traversing the chain, and causes more time spend on
-    calculating the hash.*/
-    result ^= ((unsigned)data[pos + 0] << 0u);
-    result ^= ((unsigned)data[pos + 1] << 4u);
-    result ^= ((unsigned)data[pos + 2] << 8u);
+  if(pos + 3 < size) {
+    /*Multiplicative (Fibonacci) hash, the top bits of the product depend on all 4 bytes*/
+    result = (unsigned)data[pos + 0] | ((unsigned)data[pos + 1] << 8u) |
+             ((unsigned)data[pos + 2] << 16u) | ((unsigned)data[pos + 3] << 24u);
+    result = ((result * 2654435761u) & 0xffffffffu) >> 18u;
   } else {
     size_t amount, i;
     if(pos >= size) return 0;
@@ -1554,25 +1566,62 @@ static unsigned getHash(const unsigned char* data, size_t size, size_t pos) {
   return result & HASH_BIT_MASK;
 }
 
-static unsigned countZeros(const unsigned char* data, size_t size, size_t pos) {
+/*Returns how many of the bytes from a on equal those from b on, without going past end_b. When the
+compiler can count trailing zeros, compares a whole word at a time: on little endian the lowest set
+bit of the xor of two words is in the first differing byte.*/
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__SIZEOF_SIZE_T__) && defined(__SIZEOF_LONG__)
+#if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) && (__SIZEOF_SIZE_T__ == __SIZEOF_LONG__)
+#define LODEPNG_WORD_COMPARE
+#endif
+#endif
+static unsigned countMatch(const unsigned char* a, const unsigned char* b, const unsigned char* end_b) {
+  const unsigned char* start = b;
+#ifdef LODEPNG_WORD_COMPARE
+  while((size_t)(end_b - b) >= sizeof(size_t)) {
+    size_t wa, wb;
+    lodepng_memcpy(&wa, a, sizeof(size_t));
+    lodepng_memcpy(&wb, b, sizeof(size_t));
+    if(wa != wb) return (unsigned)(b - start) + (unsigned)__builtin_ctzl(wa ^ wb) / 8u;
+    a += sizeof(size_t);
+    b += sizeof(size_t);
+  }
+#endif /*LODEPNG_WORD_COMPARE*/
+  while(b != end_b && *a == *b) {
+    ++a;
+    ++b;
+  }
+  /*subtracting two addresses returned as 32-bit number (max value is MAX_SUPPORTED_DEFLATE_LENGTH)*/
+  return (unsigned)(b - start);
+}
+
+/*Returns the length of the run of the byte at pos, if the 3 bytes from pos on are the same, or 0 otherwise*/
+static unsigned countRun(const unsigned char* data, size_t size, size_t pos) {
   const unsigned char* start = data + pos;
   const unsigned char* end = start + MAX_SUPPORTED_DEFLATE_LENGTH;
+  if(pos + 2 >= size || start[1] != start[0] || start[2] != start[0]) return 0;
   if(end > data + size) end = data + size;
-  data = start;
-  while(data != end && *data == 0) ++data;
-  /*subtracting two addresses returned as 32-bit number (max value is MAX_SUPPORTED_DEFLATE_LENGTH)*/
+  data = start + 3;
+  while(data != end && *data == *start) ++data;
   return (unsigned)(data - start);
 }
 
+/*Returns the run length at pos, given the one at pos - 1, without counting the whole run again*/
+static unsigned updateRun(const unsigned char* data, size_t size, size_t pos, unsigned numrun) {
+  if(numrun <= 3) return countRun(data, size, pos);
+  /*the run goes on at pos, and is only as long as before if it was cut off at the maximum length*/
+  if(pos + numrun > size || data[pos + numrun - 1] != data[pos]) --numrun;
+  return numrun;
+}
+
 /*wpos = pos & (windowsize - 1)*/
-static void updateHashChain(Hash* hash, size_t wpos, unsigned hashval, unsigned short numzeros) {
+static void updateHashChain(Hash* hash, size_t wpos, unsigned hashval, unsigned short numrun) {
   hash->val[wpos] = (int)hashval;
   if(hash->head[hashval] != -1) hash->chain[wpos] = hash->head[hashval];
   hash->head[hashval] = (int)wpos;
 
-  hash->zeros[wpos] = numzeros;
-  if(hash->headz[numzeros] != -1) hash->chainz[wpos] = hash->headz[numzeros];
-  hash->headz[numzeros] = (int)wpos;
+  hash->runs[wpos] = numrun;
+  if(hash->headr[numrun] != -1) hash->chainr[wpos] = hash->headr[numrun];
+  hash->headr[numrun] = (int)wpos;
 }
 
 /*
@@ -1584,7 +1633,7 @@ sliding window (of windowsize) is used, and all past bytes in that window can be
 the "dictionary". A brute force search through all possible distances would be slow, and
 this hash technique is one out of several ways to speed this up.
 */
-static unsigned encodeLZ77(uivector* out, Hash* hash,
+static unsigned encodeLZ77(LZ77Block* out, Hash* hash,
                            const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
                            unsigned minmatch, unsigned nicematch, unsigned lazymatching) {
   size_t pos;
@@ -1593,8 +1642,8 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   unsigned maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8u;
   unsigned maxlazymatch = windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
 
-  unsigned usezeros = 1; /*not sure if setting it to false for windowsize < 8192 is better or worse*/
-  unsigned numzeros = 0;
+  unsigned useruns = 1; /*not sure if setting it to false for windowsize < 8192 is better or worse*/
+  unsigned numrun = 0;
 
   unsigned offset; /*the offset represents the distance in LZ77 terminology*/
   unsigned length;
@@ -1616,15 +1665,9 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
     unsigned chainlength = 0;
 
     hashval = getHash(in, insize, pos);
+    numrun = useruns ? updateRun(in, insize, pos, numrun) : 0;
 
-    if(usezeros && hashval == 0) {
-      if(numzeros == 0) numzeros = countZeros(in, insize, pos);
-      else if(pos + numzeros > insize || in[pos + numzeros - 1] != 0) --numzeros;
-    } else {
-      numzeros = 0;
-    }
-
-    updateHashChain(hash, wpos, hashval, numzeros);
+    updateHashChain(hash, wpos, hashval, numrun);
 
     /*the length and offset found for the current position*/
     length = 0;
@@ -1647,19 +1690,16 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
         foreptr = &in[pos];
         backptr = &in[pos - current_offset];
 
-        /*common case in PNGs is lots of zeros. Quickly skip over them as a speedup*/
-        if(numzeros >= 3) {
-          unsigned skip = hash->zeros[hashpos];
-          if(skip > numzeros) skip = numzeros;
+        /*common case in PNGs is long runs of the same byte. Quickly skip over them as a speedup*/
+        if(numrun >= 3 && *backptr == *foreptr) {
+          unsigned skip = hash->runs[hashpos];
+          if(skip > numrun) skip = numrun;
           backptr += skip;
           foreptr += skip;
         }
 
-        while(foreptr != lastptr && *backptr == *foreptr) /*maximum supported length by deflate is max length*/ {
-          ++backptr;
-          ++foreptr;
-        }
-        current_length = (unsigned)(foreptr - &in[pos]);
+        /*maximum supported length by deflate is max length*/
+        current_length = (unsigned)(foreptr - &in[pos]) + countMatch(backptr, foreptr, lastptr);
 
         if(current_length > length) {
           length = current_length; /*the longest length*/
@@ -1672,9 +1712,9 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
 
       if(hashpos == hash->chain[hashpos]) break;
 
-      if(numzeros >= 3 && length > numzeros) {
-        hashpos = hash->chainz[hashpos];
-        if(hash->zeros[hashpos] != numzeros) break;
+      if(numrun >= 3 && length > numrun) {
+        hashpos = hash->chainr[hashpos];
+        if(hash->runs[hashpos] != numrun) break;
       } else {
         hashpos = hash->chain[hashpos];
         /*outdated hash value, happens if particular value was not encountered in whole last window*/
@@ -1694,12 +1734,12 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
         if(pos == 0) ERROR_BREAK(81);
         if(length > lazylength + 1) {
           /*push the previous character as literal*/
-          if(!uivector_push_back(out, in[pos - 1])) ERROR_BREAK(83 /*alloc fail*/);
+          LZ77Block_addLiteral(out, in[pos - 1]);
         } else {
           length = lazylength;
           offset = lazyoffset;
           hash->head[hashval] = -1; /*the same hashchain update will be done, this ensures no wrong alteration*/
-          hash->headz[numzeros] = -1; /*idem*/
+          hash->headr[numrun] = -1; /*idem*/
           --pos;
         }
       }
@@ -1708,24 +1748,19 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
 
     /*encode it as length/distance pair or literal value*/
     if(length < 3) /*only lengths of 3 or higher are supported as length/distance pair*/ {
-      if(!uivector_push_back(out, in[pos])) ERROR_BREAK(83 /*alloc fail*/);
+      LZ77Block_addLiteral(out, in[pos]);
     } else if(length < minmatch || (length == 3 && offset > 4096)) {
       /*compensate for the fact that longer offsets have more extra bits, a
       length of only 3 may be not worth it then*/
-      if(!uivector_push_back(out, in[pos])) ERROR_BREAK(83 /*alloc fail*/);
+      LZ77Block_addLiteral(out, in[pos]);
     } else {
-      addLengthDistance(out, length, offset);
+      LZ77Block_addLengthDistance(out, length, offset);
       for(i = 1; i < length; ++i) {
         ++pos;
         wpos = pos & (windowsize - 1);
         hashval = getHash(in, insize, pos);
-        if(usezeros && hashval == 0) {
-          if(numzeros == 0) numzeros = countZeros(in, insize, pos);
-          else if(pos + numzeros > insize || in[pos + numzeros - 1] != 0) --numzeros;
-        } else {
-          numzeros = 0;
-        }
-        updateHashChain(hash, wpos, hashval, numzeros);
+        numrun = useruns ? updateRun(in, insize, pos, numrun) : 0;
+        updateHashChain(hash, wpos, hashval, numrun);
       }
     }
   } /*end of the loop through each character of input*/
@@ -1773,32 +1808,254 @@ write the lz77-encoded data, which has lit, len and dist codes, to compressed st
 tree_ll: the tree for lit and len codes.
 tree_d: the tree for distance codes.
 */
-static void writeLZ77data(LodePNGBitWriter* writer, const uivector* lz77_encoded,
+static void writeLZ77data(LodePNGBitWriter* writer, const LZ77Block* lz77,
                           const HuffmanTree* tree_ll, const HuffmanTree* tree_d) {
-  size_t i = 0;
-  for(i = 0; i != lz77_encoded->size; ++i) {
-    unsigned val = lz77_encoded->data[i];
-    writeBitsReversed(writer, tree_ll->codes[val], tree_ll->lengths[val]);
-    if(val > 256) /*for a length code, 3 more things have to be added*/ {
-      unsigned length_index = val - FIRST_LENGTH_CODE_INDEX;
-      unsigned n_length_extra_bits = LENGTHEXTRA[length_index];
-      unsigned length_extra_bits = lz77_encoded->data[++i];
+  size_t i, numbits = 0;
+  /*the exact size from the frequencies, or a bit more if unused codes were counted*/
+  for(i = 0; i != 286; ++i) {
+    size_t extra = i > 256 ? LENGTHEXTRA[i - FIRST_LENGTH_CODE_INDEX] : 0;
+    if(i < tree_ll->numcodes) numbits += (size_t)lz77->frequencies_ll[i] * (tree_ll->lengths[i] + extra);
+  }
+  for(i = 0; i != 30; ++i) {
+    if(i < tree_d->numcodes) numbits += (size_t)lz77->frequencies_d[i] * (tree_d->lengths[i] + DISTANCEEXTRA[i]);
+  }
+  reserveBits(writer, numbits / 8u + BITWRITER_FLUSH_BYTES);
+
+  for(i = 0; i != lz77->size; ++i) {
+    unsigned litlen = lz77->symbols[i].litlen;
+    if(litlen < 256) {
+      writeHuffmanSymbol(writer, tree_ll, litlen);
+    } else {
+      unsigned length = litlen - 256u;
+      unsigned distance = lz77->symbols[i].dist;
+      unsigned length_index = lz77->length_code[length];
+      unsigned distance_index = LZ77Block_distCode(lz77, distance);
+
+      writeHuffmanSymbol(writer, tree_ll, FIRST_LENGTH_CODE_INDEX + length_index);
+      writeBits(writer, length - LENGTHBASE[length_index], LENGTHEXTRA[length_index]);
+      writeHuffmanSymbol(writer, tree_d, distance_index);
+      writeBits(writer, distance - DISTANCEBASE[distance_index], DISTANCEEXTRA[distance_index]);
+    }
+  }
+}
 
-      unsigned distance_code = lz77_encoded->data[++i];
+/* integer binary logarithm, max return value is 31 */
+static size_t ilog2(size_t i) {
+  size_t result = 0;
+  if(i >= 65536) { result += 16; i >>= 16; }
+  if(i >= 256) { result += 8; i >>= 8; }
+  if(i >= 16) { result += 4; i >>= 4; }
+  if(i >= 4) { result += 2; i >>= 2; }
+  if(i >= 2) { result += 1; /*i >>= 1;*/ }
+  return result;
+}
+
+/*log2(i) in 1/256ths of a bit, accurate to about 0.01 bit*/
+static size_t ilog2fixed(size_t i) {
+  size_t l = ilog2(i);
+  size_t x = (l >= 8 ? (i >> (l - 8u)) : (i << (8u - l))) - 256u; /*fractional part, linearly*/
+  /*log2(1 + x) is about x + 0.3466 * x * (1 - x), with 89 / 256 as 0.3466*/
+  return (l << 8u) + x + ((x * (256u - x) * 89u) >> 16u);
+}
+
+/*Adds the cost in bits of the symbols with the given code lengths to cost, and their entropy in 1/256ths
+of a bit to entropy. Returns 0 if a symbol that occurs has no code.*/
+static unsigned huffmanCost(size_t* cost, size_t* entropy, const unsigned* frequencies, size_t numcodes,
+                            const unsigned* lengths, size_t numlengths) {
+  size_t i, total = 0, logtotal;
+  for(i = 0; i != numcodes; ++i) total += frequencies[i];
+  if(total == 0) return 1;
+  logtotal = ilog2fixed(total);
+  for(i = 0; i != numcodes; ++i) {
+    if(frequencies[i] == 0) continue;
+    if(i >= numlengths || lengths[i] == 0) return 0;
+    *cost += (size_t)frequencies[i] * lengths[i];
+    *entropy += (size_t)frequencies[i] * (logtotal - ilog2fixed(frequencies[i]));
+  }
+  return 1;
+}
+
+/*run-length compress bitlen_lld into bitlen_lld_e by using repeat codes 16 (copy length 3-6 times),
+17 (3-10 zeroes), 18 (11-138 zeroes). Returns the size of bitlen_lld_e, which is never more than numcodes_lld.*/
+static size_t encodeCodeLengths(unsigned* bitlen_lld_e, const unsigned* bitlen_lld, size_t numcodes_lld) {
+  size_t i, numcodes_lld_e = 0;
+  for(i = 0; i != numcodes_lld; ++i) {
+    unsigned j = 0; /*amount of repetitions*/
+    while(i + j + 1 < numcodes_lld && bitlen_lld[i + j + 1] == bitlen_lld[i]) ++j;
+
+    if(bitlen_lld[i] == 0 && j >= 2) /*repeat code for zeroes*/ {
+      ++j; /*include the first zero*/
+      if(j <= 10) /*repeat code 17 supports max 10 zeroes*/ {
+        bitlen_lld_e[numcodes_lld_e++] = 17;
+        bitlen_lld_e[numcodes_lld_e++] = j - 3;
+      } else /*repeat code 18 supports max 138 zeroes*/ {
+        if(j > 138) j = 138;
+        bitlen_lld_e[numcodes_lld_e++] = 18;
+        bitlen_lld_e[numcodes_lld_e++] = j - 11;
+      }
+      i += (j - 1);
+    } else if(j >= 3) /*repeat code for value other than zero*/ {
+      size_t k;
+      unsigned num = j / 6u, rest = j % 6u;
+      bitlen_lld_e[numcodes_lld_e++] = bitlen_lld[i];
+      for(k = 0; k < num; ++k) {
+        bitlen_lld_e[numcodes_lld_e++] = 16;
+        bitlen_lld_e[numcodes_lld_e++] = 6 - 3;
+      }
+      if(rest >= 3) {
+        bitlen_lld_e[numcodes_lld_e++] = 16;
+        bitlen_lld_e[numcodes_lld_e++] = rest - 3;
+      }
+      else j -= rest;
+      i += j;
+    } else /*too short to benefit from repeat code*/ {
+      bitlen_lld_e[numcodes_lld_e++] = bitlen_lld[i];
+    }
+  }
+  return numcodes_lld_e;
+}
+
+/*generate tree_cl, the huffmantree of huffmantrees, and the amount of code-length-code-lengths to output*/
+static unsigned makeCodeLengthTree(HuffmanTree* tree_cl, size_t* numcodes_cl,
+                                   const unsigned* bitlen_lld_e, size_t numcodes_lld_e) {
+  unsigned frequencies_cl[NUM_CODE_LENGTH_CODES]; /*frequency of code length codes*/
+  unsigned error;
+  size_t i;
+
+  lodepng_memset(frequencies_cl, 0, sizeof(frequencies_cl));
+  for(i = 0; i != numcodes_lld_e; ++i) {
+    ++frequencies_cl[bitlen_lld_e[i]];
+    /*after a repeat code come the bits that specify the number of repetitions,
+    those don't need to be in the frequencies_cl calculation*/
+    if(bitlen_lld_e[i] >= 16) ++i;
+  }
+
+  error = HuffmanTree_makeFromFrequencies(tree_cl, frequencies_cl,
+                                          NUM_CODE_LENGTH_CODES, NUM_CODE_LENGTH_CODES, 7);
+  if(error) return error;
+
+  *numcodes_cl = NUM_CODE_LENGTH_CODES;
+  /*trim zeros at the end (using CLCL_ORDER), but minimum size must be 4 (see HCLEN in deflateDynamic)*/
+  while(*numcodes_cl > 4u && tree_cl->lengths[CLCL_ORDER[*numcodes_cl - 1u]] == 0) {
+    --*numcodes_cl;
+  }
+  return 0;
+}
+
+/*Computes the size in bits of what a dynamic block writes to describe the trees with the given code lengths: the
+HLIT, HDIST and HCLEN values, the code length code lengths and the run-length encoded code lengths.*/
+static unsigned treeHeaderBits(size_t* bits, const unsigned* lengths_ll, size_t numcodes_ll,
+                               const unsigned* lengths_d, size_t numcodes_d) {
+  unsigned bitlen_lld[286 + 30];
+  unsigned bitlen_lld_e[286 + 30];
+  HuffmanTree tree_cl;
+  size_t i, numcodes_lld_e, numcodes_cl = 0;
+  unsigned error;
+
+  for(i = 0; i != numcodes_ll; ++i) bitlen_lld[i] = lengths_ll[i];
+  for(i = 0; i != numcodes_d; ++i) bitlen_lld[numcodes_ll + i] = lengths_d[i];
+  numcodes_lld_e = encodeCodeLengths(bitlen_lld_e, bitlen_lld, numcodes_ll + numcodes_d);
+
+  HuffmanTree_init(&tree_cl);
+  error = makeCodeLengthTree(&tree_cl, &numcodes_cl, bitlen_lld_e, numcodes_lld_e);
+  if(!error) {
+    *bits = 5 + 5 + 4 + numcodes_cl * 3;
+    for(i = 0; i != numcodes_lld_e; ++i) {
+      *bits += tree_cl.lengths[bitlen_lld_e[i]];
+      /*extra bits of repeat codes*/
+      if(bitlen_lld_e[i] == 16) { *bits += 2; ++i; }
+      else if(bitlen_lld_e[i] == 17) { *bits += 3; ++i; }
+      else if(bitlen_lld_e[i] == 18) { *bits += 7; ++i; }
+    }
+  }
+  HuffmanTree_cleanup(&tree_cl);
+  return error;
+}
 
-      unsigned distance_index = distance_code;
-      unsigned n_distance_extra_bits = DISTANCEEXTRA[distance_index];
-      unsigned distance_extra_bits = lz77_encoded->data[++i];
+/*Gives every unused symbol of a complete code a code of the maximum length, then lengthens the longest codes to
+make room for them, and shortens some codes again where that made too much room, so the code stays complete as
+decoders such as zlib require. Returns whether it is complete in the end, which it is unless it was not at first.*/
+static unsigned completeCodeLengths(unsigned* lengths, size_t numcodes, unsigned maxbitlen) {
+  /*the Kraft sum of the code lengths, in units of the shortest interval, full when the code is complete*/
+  size_t kraft = 0, full = (size_t)1u << maxbitlen, i;
+  unsigned l, changed = 1;
 
-      writeBits(writer, length_extra_bits, n_length_extra_bits);
-      writeBitsReversed(writer, tree_d->codes[distance_code], tree_d->lengths[distance_code]);
-      writeBits(writer, distance_extra_bits, n_distance_extra_bits);
+  for(i = 0; i != numcodes; ++i) {
+    if(lengths[i] == 0) lengths[i] = maxbitlen;
+    kraft += (size_t)1u << (maxbitlen - lengths[i]);
+  }
+  /*lengthening a code by one halves its interval, the longest ones belong to the rarest symbols*/
+  while(kraft > full && changed) {
+    changed = 0;
+    for(l = maxbitlen - 1u; l != 0 && kraft > full; --l) {
+      for(i = 0; i != numcodes && kraft > full; ++i) {
+        if(lengths[i] != l) continue;
+        ++lengths[i];
+        kraft -= (size_t)1u << (maxbitlen - l - 1u);
+        changed = 1;
+      }
     }
   }
+  /*then fill what is left with the largest steps that fit, each shortening doubles the interval of a code*/
+  for(l = 2; l <= maxbitlen && kraft < full; ++l) {
+    size_t step = (size_t)1u << (maxbitlen - l);
+    for(i = 0; i != numcodes && kraft < full; ++i) {
+      if(lengths[i] != l || kraft + step > full) continue;
+      --lengths[i];
+      kraft += step;
+    }
+  }
+  return kraft == full;
+}
+
+/*Whether the cached trees can encode the block at most threshold percent worse than new trees would. The cost
+of new trees is estimated from the entropy of the block, scaled by how far above the entropy the trees built
+last time ended up, which depends a lot on the kind of data. Both sides include the description of the trees,
+which for the cached ones is long since they give every symbol a code.*/
+static unsigned huffmanCacheFits(const LodePNGHuffmanCache* cache, const unsigned* frequencies_ll,
+                                 const unsigned* frequencies_d, unsigned threshold) {
+  size_t cost = 0, entropy = 0, estimate;
+  if(!cache->valid) return 0;
+  huffmanCost(&cost, &entropy, frequencies_ll, 286, cache->lengths_ll, 286);
+  huffmanCost(&cost, &entropy, frequencies_d, 30, cache->lengths_d, 30);
+  cost += cache->header_bits;
+  estimate = (((entropy >> 8u) * cache->ratio) >> 8u) + cache->built_header_bits;
+  return cost <= estimate + estimate / 100u * threshold;
+}
+
+/*Keeps the trees of a block that just got its own trees in the cache. Every symbol gets a code, the unused ones of
+the maximum length, since the next blocks will not use exactly the same symbols. This derives from the code lengths
+already built, rather than building trees again.*/
+static unsigned huffmanCacheStore(LodePNGHuffmanCache* cache, const unsigned* frequencies_ll,
+                                  const unsigned* frequencies_d,
+                                  const HuffmanTree* tree_ll, const HuffmanTree* tree_d) {
+  size_t i, cost = 0, entropy = 0, bits = 0;
+  unsigned error;
+  huffmanCost(&cost, &entropy, frequencies_ll, 286, tree_ll->lengths, tree_ll->numcodes);
+  huffmanCost(&cost, &entropy, frequencies_d, 30, tree_d->lengths, tree_d->numcodes);
+  entropy >>= 8u;
+  cache->ratio = entropy ? (unsigned)((cost << 8u) / entropy) : 256u;
+  cache->valid = 0;
+  ++cache->rebuilt;
+
+  error = treeHeaderBits(&bits, tree_ll->lengths, tree_ll->numcodes, tree_d->lengths, tree_d->numcodes);
+  if(error) return error;
+  cache->built_header_bits = (unsigned)bits;
+
+  for(i = 0; i != 286; ++i) cache->lengths_ll[i] = i < tree_ll->numcodes ? tree_ll->lengths[i] : 0;
+  for(i = 0; i != 30; ++i) cache->lengths_d[i] = i < tree_d->numcodes ? tree_d->lengths[i] : 0;
+  if(!completeCodeLengths(cache->lengths_ll, 286, 15)) return 0;
+  if(!completeCodeLengths(cache->lengths_d, 30, 15)) return 0;
+
+  error = treeHeaderBits(&bits, cache->lengths_ll, 286, cache->lengths_d, 30);
+  if(error) return error;
+  cache->header_bits = (unsigned)bits;
+  cache->valid = 1;
+  return 0;
 }
 
 /*Deflate for a block of type "dynamic", that is, with freely, optimally, created huffman trees*/
-static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
+static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash, LZ77Block* lz77,
                                const unsigned char* data, size_t datapos, size_t dataend,
                                const LodePNGCompressSettings* settings, unsigned final) {
   unsigned error = 0;
@@ -1814,77 +2071,66 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
   the code length code lengths ("clcl").
   */
 
-  /*The lz77 encoded data, represented with integers since there will also be length and distance codes in it*/
-  uivector lz77_encoded;
   HuffmanTree tree_ll; /*tree for lit,len values*/
   HuffmanTree tree_d; /*tree for distance codes*/
   HuffmanTree tree_cl; /*tree for encoding the code lengths representing tree_ll and tree_d*/
-  unsigned* frequencies_ll = 0; /*frequency of lit,len codes*/
-  unsigned* frequencies_d = 0; /*frequency of dist codes*/
-  unsigned* frequencies_cl = 0; /*frequency of code length codes*/
+  unsigned* frequencies_ll = lz77->frequencies_ll; /*frequency of lit,len codes*/
+  unsigned* frequencies_d = lz77->frequencies_d; /*frequency of dist codes*/
   unsigned* bitlen_lld = 0; /*lit,len,dist code lengths (int bits), literally (without repeat codes).*/
   unsigned* bitlen_lld_e = 0; /*bitlen_lld encoded with repeat codes (this is a rudimentary run length compression)*/
-  size_t datasize = dataend - datapos;
 
   /*
   If we could call "bitlen_cl" the the code length code lengths ("clcl"), that is the bit lengths of codes to represent
   tree_cl in CLCL_ORDER, then due to the huffman compression of huffman tree representations ("two levels"), there are
   some analogies:
   bitlen_lld is to tree_cl what data is to tree_ll and tree_d.
-  bitlen_lld_e is to bitlen_lld what lz77_encoded is to data.
-  bitlen_cl is to bitlen_lld_e what bitlen_lld is to lz77_encoded.
+  bitlen_lld_e is to bitlen_lld what lz77 is to data.
+  bitlen_cl is to bitlen_lld_e what bitlen_lld is to lz77.
   */
 
   unsigned BFINAL = final;
   size_t i;
   size_t numcodes_ll, numcodes_d, numcodes_lld, numcodes_lld_e, numcodes_cl;
   unsigned HLIT, HDIST, HCLEN;
+  LodePNGHuffmanCache* cache = settings->huffman_cache;
+  unsigned reuse = 0;
 
-  uivector_init(&lz77_encoded);
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
   HuffmanTree_init(&tree_cl);
-  /* could fit on stack, but >1KB is on the larger side so allocate instead */
-  frequencies_ll = (unsigned*)lodepng_malloc(286 * sizeof(*frequencies_ll));
-  frequencies_d = (unsigned*)lodepng_malloc(30 * sizeof(*frequencies_d));
-  frequencies_cl = (unsigned*)lodepng_malloc(NUM_CODE_LENGTH_CODES * sizeof(*frequencies_cl));
-
-  if(!frequencies_ll || !frequencies_d || !frequencies_cl) error = 83; /*alloc fail*/
 
   /*This while loop never loops due to a break at the end, it is here to
   allow breaking out of it to the cleanup phase on error conditions.*/
   while(!error) {
-    lodepng_memset(frequencies_ll, 0, 286 * sizeof(*frequencies_ll));
-    lodepng_memset(frequencies_d, 0, 30 * sizeof(*frequencies_d));
-    lodepng_memset(frequencies_cl, 0, NUM_CODE_LENGTH_CODES * sizeof(*frequencies_cl));
-
+    /*the frequencies of lit, len and dist codes are counted along*/
+    LZ77Block_clear(lz77);
     if(settings->use_lz77) {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+      error = encodeLZ77(lz77, hash, data, datapos, dataend, settings->windowsize,
                          settings->minmatch, settings->nicematch, settings->lazymatching);
       if(error) break;
     } else {
-      if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
-      for(i = datapos; i < dataend; ++i) lz77_encoded.data[i - datapos] = data[i]; /*no LZ77, but still will be Huffman compressed*/
-    }
-
-    /*Count the frequencies of lit, len and dist codes*/
-    for(i = 0; i != lz77_encoded.size; ++i) {
-      unsigned symbol = lz77_encoded.data[i];
-      ++frequencies_ll[symbol];
-      if(symbol > 256) {
-        unsigned dist = lz77_encoded.data[i + 2];
-        ++frequencies_d[dist];
-        i += 3;
-      }
+      for(i = datapos; i < dataend; ++i) LZ77Block_addLiteral(lz77, data[i]); /*no LZ77, but still will be Huffman compressed*/
     }
     frequencies_ll[256] = 1; /*there will be exactly 1 end code, at the end of the block*/
 
-    /*Make both huffman trees, one for the lit and len codes, one for the dist codes*/
-    error = HuffmanTree_makeFromFrequencies(&tree_ll, frequencies_ll, 257, 286, 15);
-    if(error) break;
-    /*2, not 1, is chosen for mincodes: some buggy PNG decoders require at least 2 symbols in the dist tree*/
-    error = HuffmanTree_makeFromFrequencies(&tree_d, frequencies_d, 2, 30, 15);
-    if(error) break;
+    /*Make both huffman trees, one for the lit and len codes, one for the dist codes,
+    unless the ones of an earlier block are good enough*/
+    if(cache) reuse = huffmanCacheFits(cache, frequencies_ll, frequencies_d, settings->huffman_reuse_threshold);
+    if(reuse) {
+      error = HuffmanTree_makeFromLengths(&tree_ll, cache->lengths_ll, 286, 15);
+      if(error) break;
+      error = HuffmanTree_makeFromLengths(&tree_d, cache->lengths_d, 30, 15);
+      if(error) break;
+      ++cache->reused;
+    } else {
+      error = HuffmanTree_makeFromFrequencies(&tree_ll, frequencies_ll, 257, 286, 15);
+      if(error) break;
+      /*2, not 1, is chosen for mincodes: some buggy PNG decoders require at least 2 symbols in the dist tree*/
+      error = HuffmanTree_makeFromFrequencies(&tree_d, frequencies_d, 2, 30, 15);
+      if(error) break;
+      if(cache) error = huffmanCacheStore(cache, frequencies_ll, frequencies_d, &tree_ll, &tree_d);
+      if(error) break;
+    }
 
     numcodes_ll = LODEPNG_MIN(tree_ll.numcodes, 286);
     numcodes_d = LODEPNG_MIN(tree_d.numcodes, 30);
@@ -1894,66 +2140,14 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     /*numcodes_lld_e never needs more size than bitlen_lld*/
     bitlen_lld_e = (unsigned*)lodepng_malloc(numcodes_lld * sizeof(*bitlen_lld_e));
     if(!bitlen_lld || !bitlen_lld_e) ERROR_BREAK(83); /*alloc fail*/
-    numcodes_lld_e = 0;
 
     for(i = 0; i != numcodes_ll; ++i) bitlen_lld[i] = tree_ll.lengths[i];
     for(i = 0; i != numcodes_d; ++i) bitlen_lld[numcodes_ll + i] = tree_d.lengths[i];
+    numcodes_lld_e = encodeCodeLengths(bitlen_lld_e, bitlen_lld, numcodes_lld);
 
-    /*run-length compress bitlen_ldd into bitlen_lld_e by using repeat codes 16 (copy length 3-6 times),
-    17 (3-10 zeroes), 18 (11-138 zeroes)*/
-    for(i = 0; i != numcodes_lld; ++i) {
-      unsigned j = 0; /*amount of repetitions*/
-      while(i + j + 1 < numcodes_lld && bitlen_lld[i + j + 1] == bitlen_lld[i]) ++j;
-
-      if(bitlen_lld[i] == 0 && j >= 2) /*repeat code for zeroes*/ {
-        ++j; /*include the first zero*/
-        if(j <= 10) /*repeat code 17 supports max 10 zeroes*/ {
-          bitlen_lld_e[numcodes_lld_e++] = 17;
-          bitlen_lld_e[numcodes_lld_e++] = j - 3;
-        } else /*repeat code 18 supports max 138 zeroes*/ {
-          if(j > 138) j = 138;
-          bitlen_lld_e[numcodes_lld_e++] = 18;
-          bitlen_lld_e[numcodes_lld_e++] = j - 11;
-        }
-        i += (j - 1);
-      } else if(j >= 3) /*repeat code for value other than zero*/ {
-        size_t k;
-        unsigned num = j / 6u, rest = j % 6u;
-        bitlen_lld_e[numcodes_lld_e++] = bitlen_lld[i];
-        for(k = 0; k < num; ++k) {
-          bitlen_lld_e[numcodes_lld_e++] = 16;
-          bitlen_lld_e[numcodes_lld_e++] = 6 - 3;
-        }
-        if(rest >= 3) {
-          bitlen_lld_e[numcodes_lld_e++] = 16;
-          bitlen_lld_e[numcodes_lld_e++] = rest - 3;
-        }
-        else j -= rest;
-        i += j;
-      } else /*too short to benefit from repeat code*/ {
-        bitlen_lld_e[numcodes_lld_e++] = bitlen_lld[i];
-      }
-    }
-
-    /*generate tree_cl, the huffmantree of huffmantrees*/
-    for(i = 0; i != numcodes_lld_e; ++i) {
-      ++frequencies_cl[bitlen_lld_e[i]];
-      /*after a repeat code come the bits that specify the number of repetitions,
-      those don't need to be in the frequencies_cl calculation*/
-      if(bitlen_lld_e[i] >= 16) ++i;
-    }
-
-    error = HuffmanTree_makeFromFrequencies(&tree_cl, frequencies_cl,
-                                            NUM_CODE_LENGTH_CODES, NUM_CODE_LENGTH_CODES, 7);
+    error = makeCodeLengthTree(&tree_cl, &numcodes_cl, bitlen_lld_e, numcodes_lld_e);
     if(error) break;
 
-    /*compute amount of code-length-code-lengths to output*/
-    numcodes_cl = NUM_CODE_LENGTH_CODES;
-    /*trim zeros at the end (using CLCL_ORDER), but minimum size must be 4 (see HCLEN below)*/
-    while(numcodes_cl > 4u && tree_cl.lengths[CLCL_ORDER[numcodes_cl - 1u]] == 0) {
-      numcodes_cl--;
-    }
-
     /*
     Write everything into the output
 
@@ -1988,7 +2182,7 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
 
     /*write the lengths of the lit/len AND the dist alphabet*/
     for(i = 0; i != numcodes_lld_e; ++i) {
-      writeBitsReversed(writer, tree_cl.codes[bitlen_lld_e[i]], tree_cl.lengths[bitlen_lld_e[i]]);
+      writeHuffmanSymbol(writer, &tree_cl, bitlen_lld_e[i]);
       /*extra bits of repeat codes*/
       if(bitlen_lld_e[i] == 16) writeBits(writer, bitlen_lld_e[++i], 2);
       else if(bitlen_lld_e[i] == 17) writeBits(writer, bitlen_lld_e[++i], 3);
@@ -1996,31 +2190,27 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     }
 
     /*write the compressed data symbols*/
-    writeLZ77data(writer, &lz77_encoded, &tree_ll, &tree_d);
+    writeLZ77data(writer, lz77, &tree_ll, &tree_d);
     /*error: the length of the end code 256 must be larger than 0*/
     if(tree_ll.lengths[256] == 0) ERROR_BREAK(64);
 
     /*write the end code*/
-    writeBitsReversed(writer, tree_ll.codes[256], tree_ll.lengths[256]);
+    writeHuffmanSymbol(writer, &tree_ll, 256);
 
     break; /*end of error-while*/
   }
 
   /*cleanup*/
-  uivector_cleanup(&lz77_encoded);
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
   HuffmanTree_cleanup(&tree_cl);
-  lodepng_free(frequencies_ll);
-  lodepng_free(frequencies_d);
-  lodepng_free(frequencies_cl);
   lodepng_free(bitlen_lld);
   lodepng_free(bitlen_lld_e);
 
   return error;
 }
 
-static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
+static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash, LZ77Block* lz77,
                              const unsigned char* data,
                              size_t datapos, size_t dataend,
                              const LodePNGCompressSettings* settings, unsigned final) {
@@ -2043,19 +2233,17 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
     writeBits(writer, 0, 1); /*second bit of BTYPE*/
 
     if(settings->use_lz77) /*LZ77 encoded*/ {
-      uivector lz77_encoded;
-      uivector_init(&lz77_encoded);
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+      LZ77Block_clear(lz77);
+      error = encodeLZ77(lz77, hash, data, datapos, dataend, settings->windowsize,
                          settings->minmatch, settings->nicematch, settings->lazymatching);
-      if(!error) writeLZ77data(writer, &lz77_encoded, &tree_ll, &tree_d);
-      uivector_cleanup(&lz77_encoded);
+      if(!error) writeLZ77data(writer, lz77, &tree_ll, &tree_d);
     } else /*no LZ77, but still will be Huffman compressed*/ {
       for(i = datapos; i < dataend; ++i) {
-        writeBitsReversed(writer, tree_ll.codes[data[i]], tree_ll.lengths[data[i]]);
+        writeHuffmanSymbol(writer, &tree_ll, data[i]);
       }
     }
     /*add END code*/
-    if(!error) writeBitsReversed(writer,tree_ll.codes[256], tree_ll.lengths[256]);
+    if(!error) writeHuffmanSymbol(writer, &tree_ll, 256);
   }
 
   /*cleanup*/
@@ -2065,11 +2253,25 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
   return error;
 }
 
+/*Adds the positions of the preset dictionary, data[0..size-1], to the hash without encoding them,
+so that matches can be found in it as if it was an earlier block*/
+static void hashDictionary(Hash* hash, const unsigned char* data, size_t size, unsigned windowsize) {
+  size_t pos;
+  unsigned numrun = 0;
+  for(pos = 0; pos < size; ++pos) {
+    numrun = updateRun(data, size, pos, numrun);
+    updateHashChain(hash, pos & (windowsize - 1), getHash(data, size, pos), numrun);
+  }
+}
+
 static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
                                  const LodePNGCompressSettings* settings) {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
+  size_t dictsize = 0;
+  unsigned char* data = 0; /*the usable end of the dictionary followed by the input*/
   Hash hash;
+  LZ77Block* lz77 = 0;
   LodePNGBitWriter writer;
 
   LodePNGBitWriter_init(&writer, out);
@@ -2089,19 +2291,47 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
 
   error = hash_init(&hash, settings->windowsize);
 
+  if(!error) {
+    lz77 = (LZ77Block*)lodepng_malloc(sizeof(LZ77Block));
+    if(!lz77) error = 83; /*alloc fail*/
+    else if(LZ77Block_init(lz77, blocksize)) {
+      lodepng_free(lz77);
+      lz77 = 0;
+      error = 83; /*alloc fail*/
+    }
+  }
+
+  if(!error && settings->dictionary_size) {
+    /*matches can't reach further back than the window, the rest of the dictionary is not needed*/
+    dictsize = LODEPNG_MIN(settings->dictionary_size, (size_t)settings->windowsize);
+    data = (unsigned char*)lodepng_malloc(dictsize + insize);
+    if(!data) error = 83; /*alloc fail*/
+    if(!error) {
+      lodepng_memcpy(data, settings->dictionary + settings->dictionary_size - dictsize, dictsize);
+      if(insize) lodepng_memcpy(data + dictsize, in, insize);
+      hashDictionary(&hash, data, dictsize, settings->windowsize);
+      in = data;
+    }
+  }
+
   if(!error) {
     for(i = 0; i != numdeflateblocks && !error; ++i) {
       unsigned final = (i == numdeflateblocks - 1);
-      size_t start = i * blocksize;
+      size_t start = dictsize + i * blocksize;
       size_t end = start + blocksize;
-      if(end > insize) end = insize;
+      if(end > dictsize + insize) end = dictsize + insize;
 
-      if(settings->btype == 1) error = deflateFixed(&writer, &hash, in, start, end, settings, final);
-      else if(settings->btype == 2) error = deflateDynamic(&writer, &hash, in, start, end, settings, final);
+      if(settings->btype == 1) error = deflateFixed(&writer, &hash, lz77, in, start, end, settings, final);
+      else if(settings->btype == 2) error = deflateDynamic(&writer, &hash, lz77, in, start, end, settings, final);
     }
   }
 
+  if(!error) error = writeBitsEnd(&writer);
+
+  if(lz77) LZ77Block_cleanup(lz77);
+  lodepng_free(lz77);
   hash_cleanup(&hash);
+  lodepng_free(data);
 
   return error;
 }
@@ -2170,6 +2400,8 @@ static unsigned lodepng_zlib_decompressv(ucvector* out,
                                          const LodePNGDecompressSettings* settings) {
   unsigned error = 0;
   unsigned CM, CINFO, FDICT;
+  size_t headersize = 2;
+  size_t dictstart = out->size;
 
   if(insize < 2) return 53; /*error, size of zlib data too small*/
   /*read information from zlib header*/
@@ -2190,11 +2422,28 @@ static unsigned lodepng_zlib_decompressv(ucvector* out,
   }
   if(FDICT != 0) {
     /*error: the specification of PNG says about the zlib stream:
-      "The additional flags shall not specify a preset dictionary."*/
-    return 26;
+      "The additional flags shall not specify a preset dictionary."
+      Outside of PNG, the user may provide the dictionary the stream was compressed with.*/
+    if(!settings->dictionary) return 26;
+    if(insize < 6) return 53; /*error, size of zlib data too small*/
+    if(lodepng_read32bitInt(&in[2]) != adler32(settings->dictionary, (unsigned)settings->dictionary_size)) {
+      return 116; /*error: the stream was compressed with another dictionary*/
+    }
+    headersize += 4;
+    /*the dictionary is inflated into like earlier output, so back references can reach into it*/
+    if(!ucvector_resize(out, dictstart + settings->dictionary_size)) return 83; /*alloc fail*/
+    if(settings->dictionary_size) {
+      lodepng_memcpy(out->data + dictstart, settings->dictionary, settings->dictionary_size);
+    }
   }
 
-  error = inflatev(out, in + 2, insize - 2, settings);
+  error = inflatev(out, in + headersize, insize - headersize, settings);
+  if(FDICT != 0 && out->size >= dictstart + settings->dictionary_size) {
+    /*remove the dictionary again, the regions overlap so copy forward one byte at a time*/
+    size_t i, size = out->size - dictstart - settings->dictionary_size;
+    for(i = 0; i != size; ++i) out->data[dictstart + i] = out->data[dictstart + settings->dictionary_size + i];
+    out->size = dictstart + size;
+  }
   if(error) return error;
 
   if(!settings->ignore_adler32) {
@@ -2258,24 +2507,30 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   *out = NULL;
   *outsize = 0;
   if(!error) {
-    *outsize = deflatesize + 6;
+    *outsize = deflatesize + 6 + (settings->dictionary ? 4 : 0);
     *out = (unsigned char*)lodepng_malloc(*outsize);
     if(!*out) error = 83; /*alloc fail*/
   }
 
   if(!error) {
     unsigned ADLER32 = adler32(in, (unsigned)insize);
-    /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
+    /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, if FDICT 4 byte ADLER32 checksum of the dictionary,
+    deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
     unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
     unsigned FLEVEL = 0;
-    unsigned FDICT = 0;
+    unsigned FDICT = settings->dictionary ? 1 : 0;
     unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
     unsigned FCHECK = 31 - CMFFLG % 31;
+    size_t headersize = 2;
     CMFFLG += FCHECK;
 
     (*out)[0] = (unsigned char)(CMFFLG >> 8);
     (*out)[1] = (unsigned char)(CMFFLG & 255);
-    for(i = 0; i != deflatesize; ++i) (*out)[i + 2] = deflatedata[i];
+    if(FDICT) {
+      lodepng_set32bitInt(&(*out)[2], adler32(settings->dictionary, (unsigned)settings->dictionary_size));
+      headersize += 4;
+    }
+    for(i = 0; i != deflatesize; ++i) (*out)[i + headersize] = deflatedata[i];
     lodepng_set32bitInt(&(*out)[*outsize - 4], ADLER32);
   }
 
@@ -2336,9 +2591,19 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings) {
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
+
+  settings->huffman_cache = 0;
+  settings->huffman_reuse_threshold = 2;
+
+  settings->dictionary = 0;
+  settings->dictionary_size = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0, 0, 2, 0, 0};
+
+void lodepng_huffman_cache_init(LodePNGHuffmanCache* cache) {
+  lodepng_memset(cache, 0, sizeof(*cache));
+}
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2353,9 +2618,12 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings) {
   settings->custom_zlib = 0;
   settings->custom_inflate = 0;
   settings->custom_context = 0;
+
+  settings->dictionary = 0;
+  settings->dictionary_size = 0;
 }
 
-const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0, 0, 0};
+const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0, 0, 0, 0, 0};
 
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -3370,73 +3638,65 @@ static void addColorBits(unsigned char* out, size_t index, unsigned bits, unsign
   else out[index * bits / 8u] |= in;
 }
 
-typedef struct ColorTree ColorTree;
-
 /*
-One node of a color tree
+Set of RGBA colors, each with its palette index.
 This is the data structure used to count the number of unique colors and to get a palette
-index for a color. It's like an octree, but because the alpha channel is used too, each
-node has 16 instead of 8 children.
+index for a color. It's a flat open addressing hash table with linear probing, so it needs
+no allocations, and since it never holds more than 257 colors it's at most about half full.
 */
-struct ColorTree {
-  ColorTree* children[16]; /*up to 16 pointers to ColorTree of next level*/
-  int index; /*the payload. Only has a meaningful value if this is in the last level*/
-};
+#define COLOR_SET_SIZE 512 /*must be a power of two*/
+
+typedef struct ColorSet {
+  unsigned colors[COLOR_SET_SIZE]; /*the RGBA color packed in one value*/
+  short index[COLOR_SET_SIZE]; /*the payload, -1 for an empty slot*/
+  /*images tend to repeat the same color many times in a row, so remember the last one looked up*/
+  unsigned last_color;
+  int last_index;
+} ColorSet;
 
-static void color_tree_init(ColorTree* tree) {
-  lodepng_memset(tree->children, 0, 16 * sizeof(*tree->children));
-  tree->index = -1;
+static void color_set_init(ColorSet* set) {
+  size_t i;
+  for(i = 0; i != COLOR_SET_SIZE; ++i) set->index[i] = -1;
+  set->last_color = 0;
+  set->last_index = -1;
 }
 
-static void color_tree_cleanup(ColorTree* tree) {
-  int i;
-  for(i = 0; i != 16; ++i) {
-    if(tree->children[i]) {
-      color_tree_cleanup(tree->children[i]);
-      lodepng_free(tree->children[i]);
-    }
-  }
+static unsigned color_set_key(unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+  return ((unsigned)r << 24u) | ((unsigned)g << 16u) | ((unsigned)b << 8u) | (unsigned)a;
+}
+
+/*Fibonacci hashing, the top bits of the product mix all the channels*/
+static size_t color_set_slot(unsigned color) {
+  return (size_t)(((color * 2654435761u) & 0xffffffffu) >> 23u) & (COLOR_SET_SIZE - 1u);
 }
 
 /*returns -1 if color not present, its index otherwise*/
-static int color_tree_get(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
-  int bit = 0;
-  for(bit = 0; bit < 8; ++bit) {
-    int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-    if(!tree->children[i]) return -1;
-    else tree = tree->children[i];
+static int color_set_get(ColorSet* set, unsigned color) {
+  size_t slot;
+  if(color == set->last_color && set->last_index >= 0) return set->last_index;
+  for(slot = color_set_slot(color); set->index[slot] >= 0; slot = (slot + 1u) & (COLOR_SET_SIZE - 1u)) {
+    if(set->colors[slot] == color) {
+      set->last_color = color;
+      set->last_index = set->index[slot];
+      return set->last_index;
+    }
   }
-  return tree ? tree->index : -1;
+  return -1;
 }
 
-#ifdef LODEPNG_COMPILE_ENCODER
-static int color_tree_has(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
-  return color_tree_get(tree, r, g, b, a) >= 0;
-}
-#endif /*LODEPNG_COMPILE_ENCODER*/
-
-/*color is not allowed to already exist.
-Index should be >= 0 (it's signed to be compatible with using -1 for "doesn't exist")
-Returns error code, or 0 if ok*/
-static unsigned color_tree_add(ColorTree* tree,
-                               unsigned char r, unsigned char g, unsigned char b, unsigned char a, unsigned index) {
-  int bit;
-  for(bit = 0; bit < 8; ++bit) {
-    int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-    if(!tree->children[i]) {
-      tree->children[i] = (ColorTree*)lodepng_malloc(sizeof(ColorTree));
-      if(!tree->children[i]) return 83; /*alloc fail*/
-      color_tree_init(tree->children[i]);
-    }
-    tree = tree->children[i];
-  }
-  tree->index = (int)index;
-  return 0;
+/*Adds the color, or updates its index if it already exists. At most COLOR_SET_SIZE / 2 colors may be added*/
+static void color_set_add(ColorSet* set, unsigned color, unsigned index) {
+  size_t slot = color_set_slot(color);
+  while(set->index[slot] >= 0 && set->colors[slot] != color) slot = (slot + 1u) & (COLOR_SET_SIZE - 1u);
+  set->colors[slot] = color;
+  set->index[slot] = (short)index;
+  set->last_color = color;
+  set->last_index = (int)index;
 }
 
 /*put a pixel, given its RGBA color, into image of any color type*/
 static unsigned rgba8ToPixel(unsigned char* out, size_t i,
-                             const LodePNGColorMode* mode, ColorTree* tree /*for palette*/,
+                             const LodePNGColorMode* mode, ColorSet* set /*for palette*/,
                              unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
   if(mode->colortype == LCT_GREY) {
     unsigned char gray = r; /*((unsigned short)r + g + b) / 3u;*/
@@ -3458,7 +3718,7 @@ static unsigned rgba8ToPixel(unsigned char* out, size_t i,
       out[i * 6 + 4] = out[i * 6 + 5] = b;
     }
   } else if(mode->colortype == LCT_PALETTE) {
-    int index = color_tree_get(tree, r, g, b, a);
+    int index = color_set_get(set, color_set_key(r, g, b, a));
     if(index < 0) return 82; /*color not in palette*/
     if(mode->bitdepth == 8) out[i] = index;
     else addColorBits(out, i, mode->bitdepth, (unsigned)index);
@@ -3796,7 +4056,7 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
                          const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
                          unsigned w, unsigned h) {
   size_t i;
-  ColorTree tree;
+  ColorSet set;
   size_t numpixels = (size_t)w * (size_t)h;
   unsigned error = 0;
 
@@ -3810,6 +4070,7 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
     return 0;
   }
 
+  color_set_init(&set);
   if(mode_out->colortype == LCT_PALETTE) {
     size_t palettesize = mode_out->palettesize;
     const unsigned char* palette = mode_out->palette;
@@ -3830,11 +4091,9 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
       }
     }
     if(palettesize < palsize) palsize = palettesize;
-    color_tree_init(&tree);
     for(i = 0; i != palsize; ++i) {
       const unsigned char* p = &palette[i * 4];
-      error = color_tree_add(&tree, p[0], p[1], p[2], p[3], (unsigned)i);
-      if(error) break;
+      color_set_add(&set, color_set_key(p[0], p[1], p[2], p[3]), (unsigned)i);
     }
   }
 
@@ -3853,16 +4112,12 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
       unsigned char r = 0, g = 0, b = 0, a = 0;
       for(i = 0; i != numpixels; ++i) {
         getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
-        error = rgba8ToPixel(out, i, mode_out, &tree, r, g, b, a);
+        error = rgba8ToPixel(out, i, mode_out, &set, r, g, b, a);
         if(error) break;
       }
     }
   }
 
-  if(mode_out->colortype == LCT_PALETTE) {
-    color_tree_cleanup(&tree);
-  }
-
   return error;
 }
 
@@ -3964,7 +4219,7 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
                                      const unsigned char* in, unsigned w, unsigned h,
                                      const LodePNGColorMode* mode_in) {
   size_t i;
-  ColorTree tree;
+  ColorSet set;
   size_t numpixels = (size_t)w * (size_t)h;
   unsigned error = 0;
 
@@ -3983,9 +4238,9 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
   /*if palette not allowed, no need to compute numcolors*/
   if(!stats->allow_palette) numcolors_done = 1;
 
-  color_tree_init(&tree);
+  color_set_init(&set);
 
-  /*If the stats was already filled in from previous data, fill its palette in tree
+  /*If the stats was already filled in from previous data, fill its palette in set
   and mark things as done already if we know they are the most expensive case already*/
   if(stats->alpha) alpha_done = 1;
   if(stats->colored) colored_done = 1;
@@ -3996,8 +4251,7 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
   if(!numcolors_done) {
     for(i = 0; i < stats->numcolors; i++) {
       const unsigned char* color = &stats->palette[i * 4];
-      error = color_tree_add(&tree, color[0], color[1], color[2], color[3], (unsigned)i);
-      if(error) goto cleanup;
+      color_set_add(&set, color_set_key(color[0], color[1], color[2], color[3]), (unsigned)i);
     }
   }
 
@@ -4062,6 +4316,30 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
     }
   } else /* < 16-bit */ {
     unsigned char r = 0, g = 0, b = 0, a = 0;
+    /*at most 8 bits per channel are possible here, also for RGB and RGBA with their larger bpp*/
+    unsigned maxbits = LODEPNG_MIN(bpp, 8u);
+
+    if(mode_in->colortype == LCT_RGBA && mode_in->bitdepth == 8) {
+      /*Settle alpha and colored for the whole image up front with branchless reductions, which
+      compilers vectorize. The per pixel loop below is then left with just counting colors.*/
+      if(!alpha_done) {
+        unsigned char opaque = 255;
+        for(i = 0; i != numpixels; ++i) opaque &= in[i * 4 + 3];
+        /*all opaque means no alpha and no color key, a key of earlier data is checked after the loop*/
+        if(opaque == 255) alpha_done = 1;
+      }
+      if(!colored_done) {
+        unsigned char diff = 0;
+        for(i = 0; i != numpixels; ++i) diff |= (in[i * 4 + 0] ^ in[i * 4 + 1]) | (in[i * 4 + 0] ^ in[i * 4 + 2]);
+        if(diff) {
+          stats->colored = 1;
+          if(stats->bits < 8) stats->bits = 8; /*PNG has no colored modes with less than 8-bit per channel*/
+        }
+        /*if no pixel is colored there's nothing left to find either*/
+        colored_done = 1;
+      }
+    }
+
     for(i = 0; i != numpixels; ++i) {
       getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
 
@@ -4070,7 +4348,7 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
         unsigned bits = getValueRequiredBits(r);
         if(bits > stats->bits) stats->bits = bits;
       }
-      bits_done = (stats->bits >= bpp);
+      bits_done = (stats->bits >= maxbits);
 
       if(!colored_done && (r != g || r != b)) {
         stats->colored = 1;
@@ -4100,9 +4378,9 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
       }
 
       if(!numcolors_done) {
-        if(!color_tree_has(&tree, r, g, b, a)) {
-          error = color_tree_add(&tree, r, g, b, a, stats->numcolors);
-          if(error) goto cleanup;
+        unsigned color = color_set_key(r, g, b, a);
+        if(color_set_get(&set, color) < 0) {
+          color_set_add(&set, color, stats->numcolors);
           if(stats->numcolors < 256) {
             unsigned char* p = stats->palette;
             unsigned n = stats->numcolors;
@@ -4138,8 +4416,6 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
     stats->key_b += (stats->key_b << 8);
   }
 
-cleanup:
-  color_tree_cleanup(&tree);
   return error;
 }
 
@@ -5832,7 +6108,7 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
   size_t i;
   switch(filterType) {
     case 0: /*None*/
-      for(i = 0; i != length; ++i) out[i] = scanline[i];
+      lodepng_memcpy(out, scanline, length);
       break;
     case 1: /*Sub*/
       for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
@@ -5871,15 +6147,36 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
   }
 }
 
-/* integer binary logarithm, max return value is 31 */
-static size_t ilog2(size_t i) {
-  size_t result = 0;
-  if(i >= 65536) { result += 16; i >>= 16; }
-  if(i >= 256) { result += 8; i >>= 8; }
-  if(i >= 16) { result += 4; i >>= 4; }
-  if(i >= 4) { result += 2; i >>= 2; }
-  if(i >= 2) { result += 1; /*i >>= 1;*/ }
-  return result;
+/*Applies the five filter types to a scanline in a single pass, into attempt[0..4], and sums each the
+way the minimum sum heuristic scores them. prevline may not be null, give a line of zeros for the first
+scanline, which filters the same. Reading each byte and its neighbours once rather than five times
+halves the time of the heuristic.*/
+static void filterScanlineAll(unsigned char** attempt, size_t* sum, const unsigned char* scanline,
+                              const unsigned char* prevline, size_t length, size_t bytewidth) {
+  size_t i;
+  size_t sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0, sum4 = 0;
+  unsigned char f;
+  /*For differences, each byte should be treated as signed, values above 127 are negative
+  (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
+  This means filtertype 0 is almost never chosen, but that is justified.*/
+  for(i = 0; i != bytewidth && i != length; ++i) {
+    unsigned char s = scanline[i], b = prevline[i];
+    attempt[0][i] = s; sum0 += s;
+    attempt[1][i] = s; sum1 += s < 128 ? s : (255U - s);
+    f = s - b; attempt[2][i] = f; sum2 += f < 128 ? f : (255U - f);
+    f = s - (b >> 1); attempt[3][i] = f; sum3 += f < 128 ? f : (255U - f);
+    /*paethPredictor(0, b, 0) is always b*/
+    attempt[4][i] = f = s - b; sum4 += f < 128 ? f : (255U - f);
+  }
+  for(; i < length; ++i) {
+    unsigned char s = scanline[i], a = scanline[i - bytewidth], b = prevline[i], c = prevline[i - bytewidth];
+    attempt[0][i] = s; sum0 += s;
+    f = s - a; attempt[1][i] = f; sum1 += f < 128 ? f : (255U - f);
+    f = s - b; attempt[2][i] = f; sum2 += f < 128 ? f : (255U - f);
+    f = s - ((a + b) >> 1); attempt[3][i] = f; sum3 += f < 128 ? f : (255U - f);
+    f = s - paethPredictor(a, b, c); attempt[4][i] = f; sum4 += f < 128 ? f : (255U - f);
+  }
+  sum[0] = sum0; sum[1] = sum1; sum[2] = sum2; sum[3] = sum3; sum[4] = sum4;
 }
 
 /* integer approximation for i * log2(i), helper function for LFS_ENTROPY */
@@ -5941,50 +6238,40 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   } else if(strategy == LFS_MINSUM) {
     /*adaptive filtering*/
     unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
-    size_t smallest = 0;
+    unsigned char* zeroline; /*the line above the first one*/
+    size_t sum[5];
     unsigned char type, bestType = 0;
 
+    zeroline = (unsigned char*)lodepng_malloc(linebytes);
+    if(!zeroline) error = 83; /*alloc fail*/
+    else lodepng_memset(zeroline, 0, linebytes);
     for(type = 0; type != 5; ++type) {
       attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
       if(!attempt[type]) error = 83; /*alloc fail*/
     }
 
     if(!error) {
+      prevline = zeroline;
       for(y = 0; y != h; ++y) {
-        /*try the 5 filter types*/
-        for(type = 0; type != 5; ++type) {
-          size_t sum = 0;
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-
-          /*calculate the sum of the result*/
-          if(type == 0) {
-            for(x = 0; x != linebytes; ++x) sum += (unsigned char)(attempt[type][x]);
-          } else {
-            for(x = 0; x != linebytes; ++x) {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type][x];
-              sum += s < 128 ? s : (255U - s);
-            }
-          }
+        /*try the 5 filter types at once*/
+        filterScanlineAll(attempt, sum, &in[y * linebytes], prevline, linebytes, bytewidth);
 
-          /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-          if(type == 0 || sum < smallest) {
-            bestType = type;
-            smallest = sum;
-          }
+        /*the smallest sum, the first one on ties*/
+        bestType = 0;
+        for(type = 1; type != 5; ++type) {
+          if(sum[type] < sum[bestType]) bestType = type;
         }
 
         prevline = &in[y * linebytes];
 
         /*now fill the out values*/
         out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
+        lodepng_memcpy(&out[y * (linebytes + 1) + 1], attempt[bestType], linebytes);
       }
     }
 
     for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+    lodepng_free(zeroline);
   } else if(strategy == LFS_ENTROPY) {
     unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
     size_t bestSum = 0;
@@ -6230,6 +6517,16 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
   return error;
 }
 
+/*filters the whole image like preProcessScanlines does without interlacing, for scanlines that are
+whole bytes only, so no padding bits are added. out must have room for h * (1 + w * bpp / 8) bytes.
+return value is error*/
+unsigned lodepng_filter(unsigned char* out, const unsigned char* image, unsigned w, unsigned h,
+                        const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
+  unsigned bpp = lodepng_get_bpp(color);
+  if(w * bpp % 8u != 0) return 31; /*error: scanlines would need padding bits*/
+  return filter(out, image, w, h, color, settings);
+}
+
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
 static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t datasize) {
   unsigned char* inchunk = data;
@@ -6294,6 +6591,10 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     state->error = 61; /*error: invalid btype*/
     goto cleanup;
   }
+  if(state->encoder.zlibsettings.dictionary) {
+    state->error = 26; /*error: PNG does not allow a preset dictionary*/
+    goto cleanup;
+  }
   if(info_png->interlace_method > 1) {
     state->error = 71; /*error: invalid interlace mode*/
     goto cleanup;
@@ -6785,6 +7086,7 @@ const char* lodepng_error_text(unsigned code) {
     case 113: return "ICC profile unreasonably large";
     case 114: return "sBIT chunk has wrong size for the color type of the image";
     case 115: return "sBIT value out of range";
+    case 116: return "zlib stream was compressed with another preset dictionary than the one provided";
   }
   return "unknown error code";
 }
@@ -336,6 +336,12 @@ struct LodePNGDecompressSettings {
                              const LodePNGDecompressSettings*);
 
   const void* custom_context; /*optional custom settings for custom functions*/
+
+  /*Preset dictionary for zlib streams that have FDICT set, which PNG does not allow: only for
+  lodepng_zlib_decompress used outside of PNG. Must be the same as the one given to the encoder,
+  which is checked with its Adler32. Default: null, such streams give error 26.*/
+  const unsigned char* dictionary;
+  size_t dictionary_size;
 };
 
 extern const LodePNGDecompressSettings lodepng_default_decompress_settings;
@@ -343,6 +349,28 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
+/*
+Huffman code lengths derived from the last dynamic deflate block that had its trees
+built, kept between blocks and between calls. Successive frames of a video have nearly
+the same symbol statistics, so their blocks can often be encoded with the same trees,
+which saves building them. Owned by the user, see huffman_cache in LodePNGCompressSettings.
+*/
+typedef struct LodePNGHuffmanCache {
+  /*code lengths for all symbols, also those the block did not use, so later blocks can use them too*/
+  unsigned lengths_ll[286]; /*lit,len code lengths*/
+  unsigned lengths_d[30]; /*dist code lengths*/
+  unsigned valid; /*whether anything is cached yet*/
+  unsigned ratio; /*cost of the trees built for the block relative to its entropy, in 1/256ths*/
+  unsigned header_bits; /*size of the description of the cached trees at the start of a block reusing them*/
+  unsigned built_header_bits; /*size of the description of the trees built for the block*/
+
+  /*statistics, the number of blocks that reused the trees or had new ones built*/
+  unsigned reused;
+  unsigned rebuilt;
+} LodePNGHuffmanCache;
+
+void lodepng_huffman_cache_init(LodePNGHuffmanCache* cache);
+
 /*
 Settings for zlib compression. Tweaking these settings tweaks the balance
 between speed and compression ratio.
@@ -369,6 +397,19 @@ struct LodePNGCompressSettings /*deflate = compress*/ {
                              const LodePNGCompressSettings*);
 
   const void* custom_context; /*optional custom settings for custom functions*/
+
+  /*Reuse the Huffman trees kept in this cache for dynamic blocks, as long as they are estimated to
+  cost at most huffman_reuse_threshold percent more than freshly built ones. Only the trees are
+  reused, the output is standard deflate. Default: null, trees are always built.*/
+  LodePNGHuffmanCache* huffman_cache;
+  unsigned huffman_reuse_threshold; /*in percent. Default: 2*/
+
+  /*Preset dictionary: the deflate data may refer back into the last windowsize bytes of it as if
+  they preceded the input, and lodepng_zlib_compress sets FDICT. Pays off when the input resembles
+  data the decoder already has, e.g. the previous frame of a video. PNG does not allow it, so
+  lodepng_encode gives error 26 when it is set. Default: null.*/
+  const unsigned char* dictionary;
+  size_t dictionary_size;
 };
 
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
@@ -912,6 +953,15 @@ unsigned lodepng_inspect_chunk(LodePNGState* state, size_t pos,
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+/*
+Filters the scanlines of an image in the given color mode the way the encoder does for
+IDAT, following the filter settings, for formats outside of PNG that compress filtered
+scanlines themselves. Each scanline of out starts with its filter type byte, so out must
+have size h * (1 + w * bpp / 8). Scanlines must be whole bytes, i.e. w * bpp a multiple of 8.
+*/
+unsigned lodepng_filter(unsigned char* out, const unsigned char* image, unsigned w, unsigned h,
+                        const LodePNGColorMode* color, const LodePNGEncoderSettings* settings);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*
@@ -1014,7 +1064,8 @@ unsigned lodepng_crc32(const unsigned char* buf, size_t len);
 /*
 This zlib part can be used independently to zlib compress and decompress a
 buffer. It cannot be used to create gzip files however, and it only supports the
-part of zlib that is required for PNG, it does not support dictionaries.
+part of zlib that is required for PNG, plus preset dictionaries (see the dictionary
+field of the compress and decompress settings) for use outside of PNG.
 */
 
 #ifdef LODEPNG_COMPILE_DECODER